@@ -1,47 +1,43 @@
 // The main ray tracer.
 
+#include <limits>
+#include <math.h>
+#include <string.h>
+
 #include <Fl/fl_ask.h>
 
 #include "RayTracer.h"
+#include "ThreadPool.h"
+#include "RenderStats.h"
 #include "scene/light.h"
 #include "scene/material.h"
 #include "scene/ray.h"
 #include "fileio/read.h"
 #include "fileio/parse.h"
+#include "fileio/scenecache.h"
+#include "fileio/imagewriter.h"
 
 // Trace a top-level ray through normalized window coordinates (x,y)
 // through the projection plane, and out into the scene.  All we do is
 // enter the main ray-tracing method, getting things started by plugging
-// in an initial ray weight of (0.0,0.0,0.0) and an initial recursion depth of 0.
+// in an initial ray weight of (1.0,1.0,1.0) and an initial recursion depth of 0.
 vec3f RayTracer::trace( Scene *scene, double x, double y )
 {
     ray r( vec3f(0,0,0), vec3f(0,0,0) );
-    scene->getCamera()->rayThrough( x,y,r );
-	return traceRay( scene, r, vec3f(1.0,1.0,1.0), 0 ).clamp();
+    camera.rayThrough( x,y,r );
+	STAT_RAY( PRIMARY );
+	return traceRay( scene, r, vec3f(1.0,1.0,1.0), 0 );
 }
 
-// Do recursive ray tracing!  You'll want to insert a lot of code here
-// (or places called from here) to handle reflection, refraction, etc etc.
+// Do recursive ray tracing!  thresh is the weight of the ray: how much
+// of its colour reaches the pixel, per channel.
 vec3f RayTracer::traceRay( Scene *scene, const ray& r, 
 	const vec3f& thresh, int depth )
 {
 	isect i;
 
 	if( scene->intersect( r, i ) ) {
-		// YOUR CODE HERE
-
-		// An intersection occured!  We've got work to do.  For now,
-		// this code gets the material for the surface that was intersected,
-		// and asks that material to provide a color for the ray.  
-
-		// This is a great place to insert code for recursive ray tracing.
-		// Instead of just returning the result of shade(), add some
-		// more steps: add in the contributions from reflected and refracted
-		// rays.
-
-		const Material& m = i.getMaterial();
-		return m.shade(scene, r, i);
-	
+		return shadeHit( scene, r, i, thresh, depth );
 	} else {
 		// No intersection.  This ray travels to infinity, so we color
 		// it according to the background color, which in this (simple) case
@@ -51,11 +47,140 @@ vec3f RayTracer::traceRay( Scene *scene, const ray& r,
 	}
 }
 
+// A number in [0,1) that depends only on the ray, for Russian roulette,
+// so that a render comes out the same however its pixels are spread
+// over threads.  The bits of the ray are hashed with FNV-1a and mixed
+// with the MurmurHash3 finalizer, which makes nearby rays unrelated.
+static double rayRandom( const ray& r )
+{
+	vec3f p = r.getPosition();
+	vec3f d = r.getDirection();
+	float f[6] = { p[0], p[1], p[2], d[0], d[1], d[2] };
+	unsigned int bits[6];
+	memcpy( bits, f, sizeof( bits ) );
+
+	unsigned int h = 2166136261u;
+	for( int k = 0; k < 6; ++k )
+		h = (h ^ bits[k]) * 16777619u;
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h / 4294967296.0;
+}
+
+// Should the reflected or refracted ray r, of the given weight, be
+// traced?  scale is what its colour has to be multiplied by, to make up
+// for the rays that Russian roulette drops.
+bool RayTracer::keepRay( const ray& r, const vec3f& weight, double& scale ) const
+{
+	scale = 1.0;
+	double w = weight[0] > weight[1] ? weight[0] : weight[1];
+	if( weight[2] > w )
+		w = weight[2];
+	if( w >= cutoff )
+		return true;
+	if( !roulette || w <= 0.0 )
+		return false;
+
+	double survive = w / cutoff;
+	if( rayRandom( r ) >= survive )
+		return false;
+	scale = 1.0 / survive;
+	return true;
+}
+
+// Start a secondary ray at the hit point P, moved off the surface along
+// N.  P is only known to float precision, so without this the ray can
+// find the surface it leaves again.  The distance grows with the size of
+// P's coordinates, as their rounding does, and has some margin because
+// an object that is scaled down sees it shrunk by as much.
+static ray offsetRay( const vec3f& P, const vec3f& N, const vec3f& d )
+{
+	double m = max( fabs( P[0] ), max( fabs( P[1] ), fabs( P[2] ) ) );
+	double eps = 10.0 * RAY_EPSILON * (m > 1.0 ? m : 1.0);
+	return ray( P + eps * N, d );
+}
+
+// The colour seen along r, which hit the surface described by i: what
+// the material gives there, plus what is seen along the reflected ray
+// and through the surface, weighted by kr and kt.  The reflected and
+// refracted rays carry the weight of r times kr or kt; see setCutoff().
+vec3f RayTracer::shadeHit( Scene *scene, const ray& r, const isect& i,
+	const vec3f& thresh, int depth )
+{
+	const Material& m = i.getMaterial();
+	vec3f col = m.shade(scene, r, i);
+	if( depth >= maxDepth )
+		return col;
+
+	vec3f d = r.getDirection();
+	vec3f P = r.at( i.t );
+	double scale;
+
+	// N faces the side r came from; a ray leaving the object sees the
+	// normal from behind
+	vec3f N = i.N;
+	double cosI = -N.dot( d );
+	double eta = 1.0 / m.index;
+	if( cosI < 0.0 ) {
+		N = -N;
+		cosI = -cosI;
+		eta = m.index;
+	}
+
+	// past the critical angle nothing is transmitted, and the light
+	// that would have been goes into the reflection instead
+	vec3f kr = m.kr;
+	double k = 1.0 - eta * eta * (1.0 - cosI * cosI);
+	bool refracts = !m.kt.iszero() && k >= 0.0;
+	if( !m.kt.iszero() && !refracts )
+		kr += m.kt;
+
+	if( !kr.iszero() ) {
+		vec3f weight = prod( thresh, kr );
+		ray R( offsetRay( P, N, d + (2.0 * cosI) * N ) );
+		if( keepRay( R, weight, scale ) ) {
+			STAT_RAY( REFLECT );
+			col += scale * prod( kr, traceRay( scene, R, scale * weight, depth + 1 ) );
+		}
+	}
+
+	if( refracts ) {
+		vec3f weight = prod( thresh, m.kt );
+		ray T( offsetRay( P, -N, eta * d + (eta * cosI - sqrt( k )) * N ) );
+		if( keepRay( T, weight, scale ) ) {
+			STAT_RAY( REFRACT );
+			col += scale * prod( m.kt, traceRay( scene, T, scale * weight, depth + 1 ) );
+		}
+	}
+
+	return col;
+}
+
 RayTracer::RayTracer()
 {
 	buffer = NULL;
+	radiance = NULL;
+	depths = NULL;
+	normals = NULL;
+	wantSurfaces = false;
 	buffer_width = buffer_height = 256;
 	scene = NULL;
+	ownScene = false;
+	useSceneCache = false;
+	pool = NULL;
+	ownPool = false;
+	maxDepth = 0;
+	cutoff = 1.0 / 4096.0;
+	remapLater = false;
+	toneChanged = false;
+	roulette = false;
+	aaLevels = 0;
+	aaThreshold = 0.1;
+	tilesDone = 0;
+	tilesTotal = 0;
 
 	m_bSceneLoaded = false;
 }
@@ -63,8 +188,15 @@ RayTracer::RayTracer()
 
 RayTracer::~RayTracer()
 {
+	stopProgressive();
+	if( ownPool )
+		delete pool;
 	delete [] buffer;
-	delete scene;
+	delete [] radiance;
+	delete [] depths;
+	delete [] normals;
+	if( ownScene )
+		delete scene;
 }
 
 void RayTracer::getBuffer( unsigned char *&buf, int &w, int &h )
@@ -74,9 +206,67 @@ void RayTracer::getBuffer( unsigned char *&buf, int &w, int &h )
 	h = buffer_height;
 }
 
+void RayTracer::copyBuffer( vector<unsigned char>& buf, int &w, int &h )
+{
+	lock_guard<mutex> guard( toneLock );
+	w = buffer_width;
+	h = buffer_height;
+	if( buffer )
+		buf.assign( buffer, buffer + w * h * 3 );
+	else
+		buf.clear();
+}
+
+void RayTracer::getRadiance( float *&buf, int &w, int &h )
+{
+	buf = radiance;
+	w = buffer_width;
+	h = buffer_height;
+}
+
+void RayTracer::setToneMap( const ToneMap& tm )
+{
+	lock_guard<mutex> guard( toneLock );
+	toneMap = tm;
+	if( remapLater )
+		toneChanged = true;
+	else
+		applyToneMap( 0, 0, buffer_width, buffer_height );
+}
+
+ToneMap RayTracer::getToneMap()
+{
+	lock_guard<mutex> guard( toneLock );
+	return toneMap;
+}
+
+void RayTracer::develop( int x0, int y0, int x1, int y1 )
+{
+	lock_guard<mutex> guard( toneLock );
+	applyToneMap( x0, y0, x1, y1 );
+}
+
+// develop() with toneLock held
+void RayTracer::applyToneMap( int x0, int y0, int x1, int y1 )
+{
+	if( !buffer || x0 >= x1 || y0 >= y1 )
+		return;
+
+	// whole rows are one run of pixels
+	if( x0 == 0 && x1 == buffer_width ) {
+		int k = y0 * buffer_width * 3;
+		toneMap.apply( radiance + k, buffer + k, (y1 - y0) * buffer_width );
+		return;
+	}
+	for( int j = y0; j < y1; ++j ) {
+		int k = ( x0 + j * buffer_width ) * 3;
+		toneMap.apply( radiance + k, buffer + k, x1 - x0 );
+	}
+}
+
 double RayTracer::aspectRatio()
 {
-	return scene ? scene->getCamera()->getAspectRatio() : 1;
+	return scene ? camera.getAspectRatio() : 1;
 }
 
 bool RayTracer::sceneLoaded()
@@ -86,9 +276,10 @@ bool RayTracer::sceneLoaded()
 
 bool RayTracer::loadScene( char* fn )
 {
+	Scene *loaded;
 	try
 	{
-		scene = readScene( fn );
+		loaded = useSceneCache ? SceneCache::readScene( fn ) : readScene( fn );
 	}
 	catch( ParseError pe )
 	{
@@ -96,28 +287,97 @@ bool RayTracer::loadScene( char* fn )
 		return false;
 	}
 
-	if( !scene )
+	return setupScene( loaded );
+}
+
+bool RayTracer::loadScene( istream& is )
+{
+	Scene *loaded;
+	try
+	{
+		loaded = readScene( is );
+	}
+	catch( ParseError& pe )
+	{
+		fl_alert( "ParseError: %s\n", pe.getMsg().c_str() );
 		return false;
-	
-	buffer_width = 256;
-	buffer_height = (int)(buffer_width / scene->getCamera()->getAspectRatio() + 0.5);
+	}
 
-	bufferSize = buffer_width * buffer_height * 3;
-	buffer = new unsigned char[ bufferSize ];
+	return setupScene( loaded );
+}
+
+bool RayTracer::setupScene( Scene *loaded )
+{
+	if( !loaded )
+		return false;
 	
-	// separate objects into bounded and unbounded
-	scene->initScene();
+	// separate objects into bounded and unbounded; a scene from the
+	// cache is initialized already
+	loaded->initScene();
 	
 	// Add any specialized scene loading code here
 	
-	m_bSceneLoaded = true;
+	setScene( loaded );
+	ownScene = true;
 
 	return true;
 }
 
+void RayTracer::setScene( Scene *s )
+{
+	stopProgressive();
+	if( ownScene && scene != s )
+		delete scene;
+	scene = s;
+	ownScene = false;
+	camera = *scene->getCamera();
+
+	traceSetup( 256, (int)(256 / camera.getAspectRatio() + 0.5) );
+
+	m_bSceneLoaded = true;
+}
+
+void RayTracer::setCamera( const Camera& c )
+{
+	stopProgressive();
+	camera = c;
+}
+
+void RayTracer::resetCamera()
+{
+	if( scene )
+		setCamera( *scene->getCamera() );
+}
+
+int RayTracer::numLights() const
+{
+	return scene ? scene->numLights() : 0;
+}
+
+vec3f RayTracer::getLightIntensity( int k ) const
+{
+	return scene->getLight( k )->getIntensity();
+}
+
+void RayTracer::setLightIntensity( int k, const vec3f& intensity )
+{
+	stopProgressive();
+	scene->getLight( k )->setIntensity( intensity );
+}
+
+void RayTracer::setThreadPool( ThreadPool *shared )
+{
+	stopProgressive();
+	if( ownPool )
+		delete pool;
+	pool = shared;
+	ownPool = false;
+}
+
 void RayTracer::traceSetup( int w, int h )
 {
-	if( buffer_width != w || buffer_height != h )
+	stopProgressive();
+	if( !buffer || buffer_width != w || buffer_height != h )
 	{
 		buffer_width = w;
 		buffer_height = h;
@@ -125,39 +385,432 @@ void RayTracer::traceSetup( int w, int h )
 		bufferSize = buffer_width * buffer_height * 3;
 		delete [] buffer;
 		buffer = new unsigned char[ bufferSize ];
+		delete [] radiance;
+		radiance = new float[ bufferSize ];
+		delete [] depths;
+		delete [] normals;
+		depths = normals = NULL;
 	}
 	memset( buffer, 0, w*h*3 );
+	memset( radiance, 0, w*h*3*sizeof(float) );
+
+	if( wantSurfaces != (depths != NULL) ) {
+		delete [] depths;
+		delete [] normals;
+		depths = wantSurfaces ? new float[ w*h ] : NULL;
+		normals = wantSurfaces ? new float[ w*h*3 ] : NULL;
+	}
+	if( depths ) {
+		fill( depths, depths + w*h, numeric_limits<float>::infinity() );
+		memset( normals, 0, w*h*3*sizeof(float) );
+	}
 }
 
 void RayTracer::traceLines( int start, int stop )
 {
 	vec3f col;
+	stopProgressive();
 	if( !scene )
 		return;
 
 	if( stop > buffer_height )
 		stop = buffer_height;
 
-	for( int j = start; j < stop; ++j )
-		for( int i = 0; i < buffer_width; ++i )
-			tracePixel(i,j);
+	STAT_TIMER( RENDER );
+
+	if( aaLevels > 0 ) {
+		traceAdaptive( 0, start, buffer_width, stop );
+	} else {
+		for( int j = start; j < stop; j += 2 )
+			for( int i = 0; i < buffer_width; i += 2 )
+				tracePacket( i, j, buffer_width, stop );
+	}
+	develop( 0, start, buffer_width, stop );
+}
+
+// The pool to render on with the given number of threads (<= 0 for
+// every hardware thread); a pool handed to setThreadPool() is used as it is.
+ThreadPool *RayTracer::getPool( int threads )
+{
+	if( threads <= 0 )
+		threads = ThreadPool::hardwareThreads();
+
+	if( ownPool && pool->size() != threads ) {
+		delete pool;
+		pool = NULL;
+	}
+	if( !pool ) {
+		pool = new ThreadPool( threads );
+		ownPool = true;
+	}
+	return pool;
+}
+
+void RayTracer::traceTiles( int threads, int tileSize, ImageWriter *out )
+{
+	stopProgressive();
+	if( !scene )
+		return;
+
+	getPool( threads );
+	STAT_TIMER( RENDER );
+
+	int tilesX = (buffer_width + tileSize - 1) / tileSize;
+	int tilesY = (buffer_height + tileSize - 1) / tileSize;
+	int count = tilesX * tilesY;
+
+	// For streaming, bands are numbered in the order out writes them,
+	// and left[band] counts the tiles of a band still being traced.
+	// Floating point formats get the radiance itself.
+	bool topDown = out && out->topDown();
+	bool floats = out && out->floatingPoint();
+	vector< atomic<int> > left( out ? tilesY : 0 );
+	for( int band = 0; band < (int)left.size(); ++band )
+		left[ band ] = tilesX;
+	int written = 0;
+	mutex writeLock;
+
+	// every tile writes its own pixels of the buffer, and the scene is
+	// only read while tracing, so the tiles need no locking.
+	pool->parallelFor( count, [&]( int tile ) {
+		int tx = tile % tilesX;
+		int ty = tile / tilesX;
+		int band = 0;
+		if( out ) {
+			// the workers start at the back of their queues, so the
+			// bands due first go at the back
+			band = (count - 1 - tile) / tilesX;
+			tx = (count - 1 - tile) % tilesX;
+			ty = topDown ? tilesY - 1 - band : band;
+		}
+
+		int x0 = tx * tileSize;
+		int y0 = ty * tileSize;
+		int x1 = min( x0 + tileSize, buffer_width );
+		int y1 = min( y0 + tileSize, buffer_height );
+
+		if( aaLevels > 0 ) {
+			traceAdaptive( x0, y0, x1, y1 );
+		} else {
+			for( int j = y0; j < y1; j += 2 )
+				for( int i = x0; i < x1; i += 2 )
+					tracePacket( i, j, x1, y1 );
+		}
+		develop( x0, y0, x1, y1 );
+
+		if( !out || --left[ band ] > 0 )
+			return;
+
+		lock_guard<mutex> guard( writeLock );
+		while( written < tilesY && left[ written ] == 0 ) {
+			STAT_TIMER( WRITE );
+			int wy = topDown ? tilesY - 1 - written : written;
+			int y0 = wy * tileSize, y1 = min( (wy + 1) * tileSize, buffer_height );
+			if( floats )
+				out->writeRows( radiance, y0, y1 );
+			else
+				out->writeRows( buffer, y0, y1 );
+			++written;
+		}
+	} );
+}
+
+void RayTracer::startProgressive( int threads, int blockSize, int tileSize )
+{
+	stopProgressive();
+	if( !scene )
+		return;
+
+	// the blocks of a pass must not straddle tiles
+	tileSize = max( blockSize, tileSize / blockSize * blockSize );
+
+	int passes = 1;
+	while( (1 << (passes - 1)) < blockSize )
+		++passes;
+
+	int tilesX = (buffer_width + tileSize - 1) / tileSize;
+	int tilesY = (buffer_height + tileSize - 1) / tileSize;
+
+	progressCancel = false;
+	tilesDone = 0;
+	{
+		lock_guard<mutex> guard( toneLock );
+		remapLater = true;
+		toneChanged = false;
+	}
+	// with anti-aliasing, a last pass redoes every tile with it
+	bool antialias = aaLevels > 0;
+	tilesTotal = (passes + antialias) * tilesX * tilesY;
+	getPool( threads );
+
+	progressThread = thread( [=]() {
+		for( int pass = 0; pass < passes + antialias && !progressCancel; ++pass ) {
+			int step = pass < passes ? 1 << (passes - 1 - pass) : 0;
+			pool->parallelFor( tilesX * tilesY, [&]( int tile ) {
+				if( progressCancel )
+					return;
+
+				int x0 = (tile % tilesX) * tileSize;
+				int y0 = (tile / tilesX) * tileSize;
+				int x1 = min( x0 + tileSize, buffer_width );
+				int y1 = min( y0 + tileSize, buffer_height );
+				if( step == 0 )
+					traceAdaptive( x0, y0, x1, y1 );
+				else
+					traceBlocks( x0, y0, x1, y1, step, step < blockSize );
+				develop( x0, y0, x1, y1 );
+
+				// count the tile; the release pairs with the acquire in
+				// progress(), so once the count reaches progressTotal()
+				// every pixel of the render can be read.  Until then
+				// the buffer is only safe to read through copyBuffer().
+				tilesDone.fetch_add( 1, memory_order_release );
+			} );
+			remapIfChanged( false );
+		}
+		remapIfChanged( true );
+	} );
+}
+
+// Called by the progressive render thread between passes, when none of
+// the pool's threads is writing the radiance: map the whole buffer again
+// if setToneMap() was called during the pass.  After the last call
+// setToneMap() goes back to doing it itself.
+void RayTracer::remapIfChanged( bool last )
+{
+	lock_guard<mutex> guard( toneLock );
+	if( toneChanged )
+		applyToneMap( 0, 0, buffer_width, buffer_height );
+	toneChanged = false;
+	if( last )
+		remapLater = false;
+}
+
+void RayTracer::stopProgressive()
+{
+	if( !progressThread.joinable() )
+		return;
+
+	progressCancel = true;
+	progressThread.join();
+}
+
+bool RayTracer::progressiveDone()
+{
+	return progress() >= tilesTotal || !progressThread.joinable();
+}
+
+int RayTracer::progress()
+{
+	return tilesDone.load( memory_order_acquire );
+}
+
+// One pass of progressive rendering over the tile [x0,x1) x [y0,y1):
+// trace one pixel for every step x step block and fill the block with
+// it.  When refining, the pixels on the grid of the previous (twice as
+// coarse) pass are already done and are skipped; the blocks that are
+// filled never cover them.
+void RayTracer::traceBlocks( int x0, int y0, int x1, int y1, int step, bool refine )
+{
+	for( int j = y0; j < y1; j += step ) {
+		for( int i = x0; i < x1; i += step ) {
+			if( refine && i % (2*step) == 0 && j % (2*step) == 0 )
+				continue;
+
+			Sample s = sample( i, j );
+
+			for( int y = j; y < min( j + step, y1 ); ++y ) {
+				for( int x = i; x < min( i + step, x1 ); ++x ) {
+					setPixel( x, y, s.col );
+					setSurface( x, y, s.obj, s.t, s.N );
+				}
+			}
+		}
+	}
 }
 
 void RayTracer::tracePixel( int i, int j )
 {
-	vec3f col;
+	stopProgressive();
+	if( !scene )
+		return;
 
+	if( aaLevels > 0 ) {
+		traceAdaptive( i, j, i + 1, j + 1 );
+	} else {
+		Sample s = sample( i, j );
+		setPixel( i, j, s.col );
+		setSurface( i, j, s.obj, s.t, s.N );
+	}
+	develop( i, j, i + 1, j + 1 );
+}
+
+// Trace the 2x2 block of pixels starting at (i,j) as one packet of
+// primary rays; pixels at or past (x1,y1) are left alone.
+void RayTracer::tracePacket( int i, int j, int x1, int y1 )
+{
 	if( !scene )
 		return;
 
-	double x = double(i)/double(buffer_width);
-	double y = double(j)/double(buffer_height);
+	ray rays[ BVH::PACKET_SIZE ] = {
+		ray( vec3f(0,0,0), vec3f(0,0,0) ), ray( vec3f(0,0,0), vec3f(0,0,0) ),
+		ray( vec3f(0,0,0), vec3f(0,0,0) ), ray( vec3f(0,0,0), vec3f(0,0,0) ) };
+	isect hits[ BVH::PACKET_SIZE ];
+	int mask = 0;
+
+	for( int lane = 0; lane < BVH::PACKET_SIZE; ++lane ) {
+		int x = i + (lane & 1);
+		int y = j + (lane >> 1);
+		if( x >= x1 || y >= y1 )
+			continue;
+
+		camera.rayThrough( double(x)/double(buffer_width),
+			double(y)/double(buffer_height), rays[lane] );
+		mask |= 1 << lane;
+		STAT_RAY( PRIMARY );
+	}
+
+	int hit = scene->intersectPacket( rays, hits, mask );
+
+	for( int lane = 0; lane < BVH::PACKET_SIZE; ++lane ) {
+		if( !(mask & (1 << lane)) )
+			continue;
+
+		int x = i + (lane & 1);
+		int y = j + (lane >> 1);
+		if( hit & (1 << lane) ) {
+			setPixel( x, y, shadeHit( scene, rays[lane], hits[lane], vec3f(1.0,1.0,1.0), 0 ) );
+			setSurface( x, y, hits[lane].obj, hits[lane].t, hits[lane].N );
+		} else {
+			setPixel( x, y, vec3f( 0.0, 0.0, 0.0 ) );
+			setSurface( x, y, NULL, 0.0, vec3f( 0.0, 0.0, 0.0 ) );
+		}
+	}
+}
+
+void RayTracer::setAntialias( int levels, double threshold )
+{
+	stopProgressive();
+	aaLevels = max( 0, min( levels, 4 ) );
+	aaThreshold = threshold;
+}
+
+// Sample the scene at (x,y) in pixel units.
+RayTracer::Sample RayTracer::sample( double x, double y )
+{
+	ray r( vec3f(0,0,0), vec3f(0,0,0) );
+	camera.rayThrough( x / double(buffer_width), y / double(buffer_height), r );
+	STAT_RAY( PRIMARY );
+
+	Sample s;
+	isect i;
+	if( scene->intersect( r, i ) ) {
+		s.col = shadeHit( scene, r, i, vec3f(1.0,1.0,1.0), 0 );
+		s.obj = i.obj;
+		s.t = i.t;
+		s.N = i.N;
+	} else {
+		s.obj = NULL;
+		s.t = 0.0;
+	}
+	return s;
+}
+
+// Render the pixels [x0,x1) x [y0,y1) with adaptive anti-aliasing.  The
+// pixel corners are sampled a row at a time, each once; below that every
+// pixel keeps its own n x n grid of the sub-pixel samples taken so far,
+// so that the quarters of a pixel share the samples on their edges.
+void RayTracer::traceAdaptive( int x0, int y0, int x1, int y1 )
+{
+	int n = (1 << aaLevels) + 1;
+	int w = x1 - x0 + 1;
+	vector<Sample> top( w ), bottom( w ), grid( n * n );
+	vector<char> sampled( n * n );
+
+	for( int k = 0; k < w; ++k )
+		top[k] = sample( x0 + k, y0 );
+
+	for( int j = y0; j < y1; ++j ) {
+		for( int k = 0; k < w; ++k )
+			bottom[k] = sample( x0 + k, j + 1 );
+
+		for( int i = x0; i < x1; ++i ) {
+			fill( sampled.begin(), sampled.end(), 0 );
+			grid[ 0 ] = top[ i - x0 ];
+			grid[ n - 1 ] = top[ i - x0 + 1 ];
+			grid[ (n - 1) * n ] = bottom[ i - x0 ];
+			grid[ n * n - 1 ] = bottom[ i - x0 + 1 ];
+			sampled[ 0 ] = sampled[ n - 1 ] = sampled[ (n - 1) * n ] = sampled[ n * n - 1 ] = 1;
+
+			setPixel( i, j, refine( &grid[0], sampled.data(), n, i, j, 0, 0, n - 1 ) );
+			setSurface( i, j, grid[0].obj, grid[0].t, grid[0].N );
+		}
+		swap( top, bottom );
+	}
+}
+
+// The average colour of the square of pixel (i,j) whose corners are at
+// (u,v) and (u+size,v+size) on its n x n sample grid; the corners have
+// been sampled already.
+vec3f RayTracer::refine( Sample *grid, char *sampled, int n, int i, int j,
+	int u, int v, int size )
+{
+	const Sample *c[4] = { &grid[ u + v * n ], &grid[ u + size + v * n ],
+		&grid[ u + (v + size) * n ], &grid[ u + size + (v + size) * n ] };
+
+	vec3f sum = c[0]->col + c[1]->col + c[2]->col + c[3]->col;
+	if( size == 1 )
+		return sum * 0.25;
 
-	col = trace( scene,x,y );
+	bool same = c[1]->obj == c[0]->obj && c[2]->obj == c[0]->obj &&
+		c[3]->obj == c[0]->obj;
+	for( int k = 0; k < 3 && same; ++k ) {
+		double lo = min( min( c[0]->col[k], c[1]->col[k] ), min( c[2]->col[k], c[3]->col[k] ) );
+		double hi = max( max( c[0]->col[k], c[1]->col[k] ), max( c[2]->col[k], c[3]->col[k] ) );
+		same = hi - lo <= aaThreshold;
+	}
+	if( same )
+		return sum * 0.25;
+
+	int h = size / 2;
+	static const int mids[5][2] = { {1,0}, {0,1}, {1,1}, {2,1}, {1,2} };
+	for( int k = 0; k < 5; ++k ) {
+		int su = u + mids[k][0] * h;
+		int sv = v + mids[k][1] * h;
+		if( !sampled[ su + sv * n ] ) {
+			grid[ su + sv * n ] = sample( i + double(su) / (n - 1), j + double(sv) / (n - 1) );
+			sampled[ su + sv * n ] = 1;
+		}
+	}
 
-	unsigned char *pixel = buffer + ( i + j * buffer_width ) * 3;
+	return ( refine( grid, sampled, n, i, j, u, v, h ) +
+		refine( grid, sampled, n, i, j, u + h, v, h ) +
+		refine( grid, sampled, n, i, j, u, v + h, h ) +
+		refine( grid, sampled, n, i, j, u + h, v + h, h ) ) * 0.25;
+}
 
-	pixel[0] = (int)( 255.0 * col[0]);
-	pixel[1] = (int)( 255.0 * col[1]);
-	pixel[2] = (int)( 255.0 * col[2]);
+void RayTracer::setPixel( int i, int j, const vec3f& col )
+{
+	float *pixel = radiance + ( i + j * buffer_width ) * 3;
+
+	pixel[0] = (float)col[0];
+	pixel[1] = (float)col[1];
+	pixel[2] = (float)col[2];
+}
+
+void RayTracer::setSurface( int i, int j, const SceneObject *obj, double t, const vec3f& N )
+{
+	if( !depths )
+		return;
+
+	int k = i + j * buffer_width;
+	if( obj ) {
+		depths[k] = (float)t;
+		normals[3*k] = (float)N[0];
+		normals[3*k + 1] = (float)N[1];
+		normals[3*k + 2] = (float)N[2];
+	} else {
+		depths[k] = numeric_limits<float>::infinity();
+		normals[3*k] = normals[3*k + 1] = normals[3*k + 2] = 0.0f;
+	}
 }
\ No newline at end of file
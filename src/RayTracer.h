@@ -3,8 +3,18 @@
 
 // The main ray tracer.
 
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
 #include "scene/scene.h"
 #include "scene/ray.h"
+#include "ToneMap.h"
+
+class ThreadPool;
+class ImageWriter;
 
 class RayTracer
 {
@@ -14,23 +24,210 @@ public:
 
     vec3f trace( Scene *scene, double x, double y );
 	vec3f traceRay( Scene *scene, const ray& r, const vec3f& thresh, int depth );
+	vec3f shadeHit( Scene *scene, const ray& r, const isect& i,
+		const vec3f& thresh, int depth );
 
 
+	// The rendered image, 8 bits per channel, bottom row first.  The
+	// tracer renders into a floating point radiance buffer (below), and
+	// each part of the image is tone mapped into this one as soon as it
+	// is done.
 	void getBuffer( unsigned char *&buf, int &w, int &h );
+
+	// A copy of the 8 bit buffer that is safe to take while a
+	// progressive render runs: develop() writes the buffer a tile at a
+	// time under the lock this takes too, so the copy only has whole
+	// tiles in it.
+	void copyBuffer( vector<unsigned char>& buf, int &w, int &h );
+
+	// The radiance buffer: RGB floats, unclamped, laid out like the 8 bit
+	// buffer.
+	void getRadiance( float *&buf, int &w, int &h );
+
+	// Depth and normal buffers: for every pixel, the distance to the
+	// surface its primary ray hits and the surface normal there (for
+	// anti-aliased pixels, at the pixel's corner sample).  Pixels that
+	// hit nothing get an infinite depth and a zero normal.  Off by
+	// default, as they cost 16 bytes a pixel; turning them on takes
+	// effect at the next traceSetup().  The getters return NULL while
+	// they are off.
+	void setSurfaceBuffers( bool on ) { wantSurfaces = on; }
+	float *getDepthBuffer() { return depths; }
+	float *getNormalBuffer() { return normals; }
+
+	// How radiance becomes 8 bit pixels.  Setting a new tone map maps the
+	// whole radiance buffer again at once, which takes milliseconds.
+	// While a progressive render runs its threads are still writing the
+	// radiance, so the tiles still to come use the new map and the render
+	// maps the rest again once the pass under way is done.
+	void setToneMap( const ToneMap& tm );
+	ToneMap getToneMap();
+
+	// Tone map the pixels [x0,x1) x [y0,y1) of the radiance buffer into
+	// the 8 bit buffer; the render methods do this for what they trace.
+	void develop( int x0, int y0, int x1, int y1 );
+
 	double aspectRatio();
 	void traceSetup( int w, int h );
 	void traceLines( int start = 0, int stop = 10000000 );
 	void tracePixel( int i, int j );
 
+	// Trace the 2x2 pixels at (i,j) as a packet; only pixels left of x1
+	// and above y1 are written.  traceLines and traceTiles use this.
+	// It only fills in radiance; see develop().
+	void tracePacket( int i, int j, int x1, int y1 );
+
+	// Render the whole buffer in tileSize x tileSize tiles on a pool
+	// of worker threads (threads <= 0 uses every hardware thread).
+	// With out, which must be open at the size of the buffer, the
+	// image is written to it while it renders: the tiles are traced a
+	// band of rows at a time, in the order out stores its rows, and
+	// whichever thread finishes the band that is due next writes it
+	// (and any finished bands after it) while the others keep tracing.
+	// out is left open.
+	void traceTiles( int threads, int tileSize = 32, ImageWriter *out = NULL );
+
+	// Progressive rendering in the background, for previews.  The first
+	// pass traces one pixel per blockSize x blockSize block and fills the
+	// block with it; every further pass halves the block size, and the
+	// last one traces every pixel not traced yet, so the finished image
+	// is the same as tracePixel() gives for every pixel; with
+	// anti-aliasing on, one more pass anti-aliases it.  Each pass is
+	// split into tiles on the thread pool, and startProgressive()
+	// returns at once.
+	// progress() is the number of tiles finished so far, out of
+	// progressTotal(); the pixels of those tiles are in the buffer.
+	// stopProgressive() cancels the render and waits for it to wind
+	// down; anything that changes the scene or the buffer calls it
+	// first, and so do the other render methods.
+	void startProgressive( int threads, int blockSize = 8, int tileSize = 32 );
+	void stopProgressive();
+	bool progressiveDone();
+	int progress();
+	int progressTotal() const { return tilesTotal; }
+
 	bool loadScene( char* fn );
+	bool loadScene( istream& is );
+
+	// Have loadScene( fn ) go through the binary scene cache next to the
+	// file (see SceneCache), writing it on the first load.  Off by
+	// default; the command line renderer turns it on.
+	void setSceneCache( bool on ) { useSceneCache = on; }
+
+	// Render a scene that is already initialized and owned elsewhere,
+	// e.g. one cached and shared by several RayTracers.  The RayTracer
+	// takes a copy of the scene's camera, which getCamera() returns, so
+	// each one can look at the scene from its own viewpoint.
+	void setScene( Scene *s );
+	Camera *getCamera() { return &camera; }
+
+	// Change the view or the lighting of the loaded scene and render
+	// again, e.g. for the frames of a turntable or a flythrough.  Nothing
+	// is parsed and no hierarchy is rebuilt, so a sequence pays for
+	// building its scene once.  They stop a progressive render first.
+	// resetCamera() goes back to the camera the scene file describes.
+	// The lights belong to the scene: a scene shared by several
+	// RayTracers has the same lights in all of them, so don't change
+	// them while another one is rendering it.
+	void setCamera( const Camera& c );
+	void resetCamera();
+	int numLights() const;
+	vec3f getLightIntensity( int k ) const;
+	void setLightIntensity( int k, const vec3f& intensity );
+
+	// Have traceTiles() use a pool shared with other RayTracers instead
+	// of creating its own; the pool must outlive this RayTracer.
+	void setThreadPool( ThreadPool *shared );
+
+	// The recursion limit for reflected and refracted rays.
+	void setDepth( int depth ) { maxDepth = depth; }
+	int getDepth() const { return maxDepth; }
+
+	// A reflected or refracted ray carries a weight: the product of the
+	// kr and kt it went through on the way from the eye, per channel.
+	// Rays whose weight is below cutoff in every channel are not traced,
+	// so glassy scenes stop recursing once the rays can barely change the
+	// pixel, well before the depth limit.  The default, 1/4096, is a
+	// sixteenth of an 8 bit level, as the many rays that are cut off add
+	// up; 0 traces every ray down to the limit.  With Russian roulette
+	// on, such a ray is traced instead with probability weight / cutoff
+	// and its colour scaled up to match, which is unbiased: on average
+	// the image is the one with no cutoff, with some noise added.
+	void setCutoff( double c ) { cutoff = c; }
+	double getCutoff() const { return cutoff; }
+	void setRussianRoulette( bool on ) { roulette = on; }
+	bool getRussianRoulette() const { return roulette; }
+
+	// Adaptive anti-aliasing.  With levels > 0 each pixel is sampled at
+	// its four corners, which it shares with its neighbours; where the
+	// corners hit different objects or their colours differ by more
+	// than threshold, the pixel is split into quarters that are sampled
+	// the same way, at most levels times (so 2 levels means up to 4x4
+	// sub-pixels).  The pixel gets the average of its quarters.  0 turns
+	// anti-aliasing off and samples each pixel once, at its corner.
+	void setAntialias( int levels, double threshold = 0.1 );
+	int getAntialias() const { return aaLevels; }
 
 	bool sceneLoaded();
 
 private:
+	bool setupScene( Scene *loaded );
+	void setPixel( int i, int j, const vec3f& col );
+	void applyToneMap( int x0, int y0, int x1, int y1 );
+	void remapIfChanged( bool last );
+	ThreadPool *getPool( int threads );
+	void traceBlocks( int x0, int y0, int x1, int y1, int step, bool refine );
+
+	void setSurface( int i, int j, const SceneObject *obj, double t, const vec3f& N );
+	bool keepRay( const ray& r, const vec3f& weight, double& scale ) const;
+
+	// one sample of the image: the colour seen and the object hit, how
+	// far away it is and the normal there
+	struct Sample
+	{
+		vec3f col;
+		const SceneObject *obj;
+		double t;
+		vec3f N;
+	};
+
+	Sample sample( double x, double y );
+	void traceAdaptive( int x0, int y0, int x1, int y1 );
+	vec3f refine( Sample *grid, char *sampled, int n, int i, int j,
+		int u, int v, int size );
+
 	unsigned char *buffer;
+	float *radiance;
+	float *depths;
+	float *normals;
+	bool wantSurfaces;
 	int buffer_width, buffer_height;
 	int bufferSize;
+
+	// the tone map is set by the UI while render threads read it, and
+	// the UI copies the 8 bit buffer while they write it; develop()
+	// holds the lock throughout
+	ToneMap toneMap;
+	mutex toneLock;
+	bool remapLater;	// a progressive render remaps when a pass is done
+	bool toneChanged;	// ... and the map has changed since it last did
 	Scene *scene;
+	bool ownScene;
+	bool useSceneCache;
+	Camera camera;
+	int maxDepth;
+	double cutoff;
+	bool roulette;
+	int aaLevels;
+	double aaThreshold;
+
+	ThreadPool *pool;
+	bool ownPool;
+
+	thread progressThread;
+	atomic<bool> progressCancel;
+	atomic<int> tilesDone;
+	int tilesTotal;
 
 	bool m_bSceneLoaded;
 };
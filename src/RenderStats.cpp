@@ -0,0 +1,108 @@
+#include <vector>
+#include <mutex>
+
+#include "RenderStats.h"
+
+using namespace std;
+
+// Every thread's counters, so total() can find them.  They are never
+// freed: the counts of a finished thread still belong in the total.
+static mutex registryLock;
+static vector<RenderStats*> registry;
+
+thread_local RenderStats *RenderStats::current = NULL;
+
+RenderStats::RenderStats()
+	: rays( 0 ), boxTests( 0 ), objectTests( 0 ), objectHits( 0 ), triangleTests( 0 ), hits( 0 )
+{
+	for( int k = 0; k < RAY_TYPES; ++k )
+		raysByType[k] = 0;
+	for( int k = 0; k < PHASES; ++k )
+		seconds[k] = 0.0;
+}
+
+RenderStats *RenderStats::create()
+{
+	RenderStats *mine = new RenderStats;
+	lock_guard<mutex> guard( registryLock );
+	registry.push_back( mine );
+	return mine;
+}
+
+RenderStats RenderStats::total()
+{
+	lock_guard<mutex> guard( registryLock );
+	RenderStats sum;
+	for( int k = 0; k < (int)registry.size(); ++k ) {
+		const RenderStats& s = *registry[k];
+		sum.rays += s.rays;
+		for( int t = 0; t < RAY_TYPES; ++t )
+			sum.raysByType[t] += s.raysByType[t];
+		sum.boxTests += s.boxTests;
+		sum.objectTests += s.objectTests;
+		sum.objectHits += s.objectHits;
+		sum.triangleTests += s.triangleTests;
+		sum.hits += s.hits;
+		for( int p = 0; p < PHASES; ++p )
+			sum.seconds[p] += s.seconds[p];
+	}
+	return sum;
+}
+
+void RenderStats::reset()
+{
+	lock_guard<mutex> guard( registryLock );
+	for( int k = 0; k < (int)registry.size(); ++k )
+		*registry[k] = RenderStats();
+}
+
+const char *RenderStats::rayTypeName( int type )
+{
+	static const char *names[ RAY_TYPES ] = { "primary", "shadow", "reflect", "refract" };
+	return names[ type ];
+}
+
+const char *RenderStats::phaseName( int phase )
+{
+	static const char *names[ PHASES ] = { "parse", "init", "render", "traverse", "shade", "write" };
+	return names[ phase ];
+}
+
+static double perRay( unsigned long long n, unsigned long long rays )
+{
+	return rays ? double( n ) / rays : 0.0;
+}
+
+void RenderStats::print( FILE *f ) const
+{
+	fprintf( f, "rays             %llu\n", rays );
+	for( int t = 0; t < RAY_TYPES; ++t )
+		fprintf( f, "  %-14s %llu\n", rayTypeName( t ), raysByType[t] );
+	fprintf( f, "hits             %llu (%.1f%%)\n", hits, 100.0 * perRay( hits, rays ) );
+	fprintf( f, "box tests        %llu (%.2f per ray)\n", boxTests, perRay( boxTests, rays ) );
+	fprintf( f, "object tests     %llu (%.2f per ray)\n", objectTests, perRay( objectTests, rays ) );
+	// the rest got past the bounding boxes only to miss the object
+	fprintf( f, "object hits      %llu (%.1f%% of tests)\n", objectHits,
+		100.0 * perRay( objectHits, objectTests ) );
+	fprintf( f, "triangle tests   %llu (%.2f per ray)\n", triangleTests, perRay( triangleTests, rays ) );
+	for( int p = 0; p < PHASES; ++p ) {
+		if( seconds[p] > 0.0 )
+			fprintf( f, "%-16s %.3f seconds\n", phaseName( p ), seconds[p] );
+	}
+}
+
+void RenderStats::writeJSON( FILE *f, const char *indent ) const
+{
+	fprintf( f, "%s\"rays\": %llu,\n", indent, rays );
+	fprintf( f, "%s\"rays_by_type\": { ", indent );
+	for( int t = 0; t < RAY_TYPES; ++t )
+		fprintf( f, "\"%s\": %llu%s", rayTypeName( t ), raysByType[t], t + 1 < RAY_TYPES ? ", " : " },\n" );
+	fprintf( f, "%s\"hits\": %llu,\n", indent, hits );
+	fprintf( f, "%s\"box_tests\": %llu,\n", indent, boxTests );
+	fprintf( f, "%s\"object_tests\": %llu,\n", indent, objectTests );
+	fprintf( f, "%s\"object_hits\": %llu,\n", indent, objectHits );
+	fprintf( f, "%s\"triangle_tests\": %llu,\n", indent, triangleTests );
+	fprintf( f, "%s\"seconds\": { ", indent );
+	for( int p = 0; p < PHASES; ++p )
+		fprintf( f, "\"%s\": %.6f%s", phaseName( p ), seconds[p], p + 1 < PHASES ? ", " : " }\n" );
+}
@@ -0,0 +1,104 @@
+#ifndef __RENDERSTATS_H__
+#define __RENDERSTATS_H__
+
+// Counters and timers for measuring how much work a render does and
+// where its time goes.  Every thread counts into its own RenderStats, so
+// the hot paths need no locking; total() adds up the counters of every
+// thread that has counted anything.  All of it is only compiled in when
+// RAY_STATS is defined (the benchmark build does this); otherwise the
+// STAT_ macros vanish.  Defining RAY_STATS as 2 also times every
+// traversal and every Material::shade call, which costs a clock read per
+// ray, so it slows the render down noticeably.
+
+#include <stdio.h>
+#include <chrono>
+
+class RenderStats
+{
+public:
+	enum RayType { PRIMARY, SHADOW, REFLECT, REFRACT, RAY_TYPES };
+
+	// The phases of a render.  The times are summed over threads, so a
+	// phase run on several threads (traversal, shading) can take longer
+	// than the wall time of the render; shading includes the shadow
+	// rays it casts.
+	enum Phase { PARSE, INIT, RENDER, TRAVERSE, SHADE, WRITE, PHASES };
+
+	RenderStats();
+
+	unsigned long long rays;			// rays cast into the scene
+	unsigned long long raysByType[ RAY_TYPES ];
+	unsigned long long boxTests;		// ray/box tests in the BVHs
+	unsigned long long objectTests;		// ray/object intersection tests
+	unsigned long long objectHits;		// object tests that hit the object
+	unsigned long long triangleTests;	// ray/triangle tests inside meshes
+	unsigned long long hits;			// rays that hit something
+	double seconds[ PHASES ];
+
+	// the calling thread's counters
+	static RenderStats& local();
+
+	// the sum over all threads, and zeroing every thread's counters;
+	// only meaningful while no render is running.
+	static RenderStats total();
+	static void reset();
+
+	static const char *rayTypeName( int type );
+	static const char *phaseName( int phase );
+
+	// a human readable report, and the same as a JSON object written
+	// with the given indentation (the braces are left to the caller)
+	void print( FILE *f ) const;
+	void writeJSON( FILE *f, const char *indent ) const;
+
+private:
+	static RenderStats *create();
+	static thread_local RenderStats *current;
+};
+
+inline RenderStats& RenderStats::local()
+{
+	if( !current )
+		current = create();
+	return *current;
+}
+
+// Adds the time from its construction to its destruction to a phase of
+// the calling thread's stats.
+class StatTimer
+{
+public:
+	StatTimer( RenderStats::Phase p )
+		: phase( p ), start( std::chrono::steady_clock::now() ) {}
+	~StatTimer()
+	{
+		RenderStats::local().seconds[ phase ] += std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start ).count();
+	}
+
+private:
+	RenderStats::Phase phase;
+	std::chrono::steady_clock::time_point start;
+};
+
+#define STAT_CONCAT2( a, b ) a##b
+#define STAT_CONCAT( a, b ) STAT_CONCAT2( a, b )
+
+#ifdef RAY_STATS
+#define STAT_ADD( counter, n ) ( RenderStats::local().counter += (n) )
+#define STAT_RAY( type ) ( ++RenderStats::local().raysByType[ RenderStats::type ] )
+#define STAT_TIMER( phase ) StatTimer STAT_CONCAT( statTimer, __LINE__ )( RenderStats::phase )
+#else
+#define STAT_ADD( counter, n ) ((void)0)
+#define STAT_RAY( type ) ((void)0)
+#define STAT_TIMER( phase ) ((void)0)
+#endif
+
+// timers on the per-ray paths
+#if defined( RAY_STATS ) && RAY_STATS > 1
+#define STAT_TIMER_FINE( phase ) STAT_TIMER( phase )
+#else
+#define STAT_TIMER_FINE( phase ) ((void)0)
+#endif
+
+#endif // __RENDERSTATS_H__
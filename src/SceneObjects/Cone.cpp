@@ -3,6 +3,14 @@
 
 #include "Cone.h"
 
+// As for the cylinder, but the end disks differ in size; a radius of 0
+// is just the apex.
+void Cone::ComputeBoundingBox()
+{
+	bounds = transformDisk( 0.0, b_radius );
+	bounds.merge( transformDisk( height, t_radius ) );
+}
+
 bool Cone::intersectLocal( const ray& r, isect& i ) const
 {
 	i.obj = this;
@@ -24,8 +32,8 @@ bool Cone::intersectLocal( const ray& r, isect& i ) const
 
 bool Cone::intersectBody( const ray& r, isect& i ) const
 {
-	vec3f d = r.getDirection();
-	vec3f p = r.getPosition();
+	vec3d d( r.getDirection() );
+	vec3d p( r.getPosition() );
 
 	double a = (d[0]*d[0]) + (d[1]*d[1]) - (C*d[2]*d[2]);
 	double b = 2.0 * (d[0]*p[0] + d[1]*p[1] - C*d[2]*p[2]) - B*d[2];
@@ -22,6 +22,7 @@ public:
 
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
 	virtual bool hasBoundingBoxCapability() const { return true; }
+	virtual void ComputeBoundingBox();
 
     virtual BoundingBox ComputeLocalBoundingBox()
     {
@@ -55,6 +56,7 @@ protected:
 	double B;
 	double C;
 
+	friend class SceneCache;
 };
 
 #endif // __CONE_H__
@@ -2,6 +2,13 @@
 
 #include "Cylinder.h"
 
+// The cylinder is the hull of its two end disks, so it has their bounds.
+void Cylinder::ComputeBoundingBox()
+{
+	bounds = transformDisk( 0.0, 1.0 );
+	bounds.merge( transformDisk( 1.0, 1.0 ) );
+}
+
 bool Cylinder::intersectLocal( const ray& r, isect& i ) const
 {
 	i.obj = this;
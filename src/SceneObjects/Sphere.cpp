@@ -2,10 +2,23 @@
 
 #include "Sphere.h"
 
+// The transformed sphere is an ellipsoid; along each world axis it
+// reaches the length of that row of the linear part from its center.
+void Sphere::ComputeBoundingBox()
+{
+	vec3f center = transform->localToGlobalCoords( vec3f( 0.0, 0.0, 0.0 ) );
+	const mat3f& l = transform->getLinear();
+
+	vec3f extent( l[0].length(), l[1].length(), l[2].length() );
+	bounds.min = center - extent;
+	bounds.max = center + extent;
+}
+
 bool Sphere::intersectLocal( const ray& r, isect& i ) const
 {
-	vec3f v = -r.getPosition();
-	double b = v.dot(r.getDirection());
+	// solved in double: b*b and v.dot(v) nearly cancel for grazing rays
+	vec3d v = -vec3d( r.getPosition() );
+	double b = v.dot( vec3d( r.getDirection() ) );
 	double discriminant = b*b - v.dot(v) + 1;
 
 	if( discriminant < 0.0 ) {
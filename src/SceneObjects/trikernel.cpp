@@ -0,0 +1,292 @@
+#include "trikernel.h"
+#include "../scene/ray.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define TRI_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC accepts AVX2 intrinsics anywhere; gcc and clang need the function
+// compiled for the target, and we only call it after checking the CPU.
+#if defined(__GNUC__)
+#define TRI_AVX2_FUNC __attribute__((target("avx2")))
+#else
+#define TRI_AVX2_FUNC
+#endif
+
+static const float TRI_EPSILON = (float)RAY_EPSILON;
+
+#ifndef TRI_X86
+
+// the portable kernel, for targets without SSE
+static int intersectScalar( const float *tris, int stride, int first, int count,
+	const float org[3], const float dir[3], float tMax,
+	float& t, float& u, float& v )
+{
+	int hit = -1;
+
+	for( int k = first; k < first + count; ++k ) {
+		const float *f = tris + k;
+		float e1x = f[TRI_E1X*stride], e1y = f[TRI_E1Y*stride], e1z = f[TRI_E1Z*stride];
+		float e2x = f[TRI_E2X*stride], e2y = f[TRI_E2Y*stride], e2z = f[TRI_E2Z*stride];
+
+		float px = dir[1]*e2z - dir[2]*e2y;
+		float py = dir[2]*e2x - dir[0]*e2z;
+		float pz = dir[0]*e2y - dir[1]*e2x;
+		float det = e1x*px + e1y*py + e1z*pz;
+		if( !(det > f[TRI_MINDET*stride]) )
+			continue;
+		float inv = 1.0f / det;
+
+		float sx = org[0] - f[TRI_V0X*stride];
+		float sy = org[1] - f[TRI_V0Y*stride];
+		float sz = org[2] - f[TRI_V0Z*stride];
+		float uu = (sx*px + sy*py + sz*pz) * inv;
+		if( uu < 0.0f )
+			continue;
+
+		float qx = sy*e1z - sz*e1y;
+		float qy = sz*e1x - sx*e1z;
+		float qz = sx*e1y - sy*e1x;
+		float vv = (dir[0]*qx + dir[1]*qy + dir[2]*qz) * inv;
+		if( vv < 0.0f || uu + vv > 1.0f )
+			continue;
+
+		float tt = (e2x*qx + e2y*qy + e2z*qz) * inv;
+		if( tt < TRI_EPSILON || tt >= tMax )
+			continue;
+
+		tMax = t = tt;
+		u = uu;
+		v = vv;
+		hit = k;
+	}
+
+	return hit;
+}
+
+#endif // !TRI_X86
+
+#ifdef TRI_X86
+
+// Pick the closest of the lanes set in 'bits'; the lanes are all closer
+// than the current tMax.
+static int closestLane( int bits, const float *ts, const float *us, const float *vs,
+	int base, float& tMax, float& t, float& u, float& v )
+{
+	int hit = -1;
+	for( int lane = 0; bits; ++lane, bits >>= 1 ) {
+		if( (bits & 1) && ts[lane] < tMax ) {
+			tMax = t = ts[lane];
+			u = us[lane];
+			v = vs[lane];
+			hit = base + lane;
+		}
+	}
+	return hit;
+}
+
+static int intersectSSE( const float *tris, int stride, int first, int count,
+	const float org[3], const float dir[3], float tMax,
+	float& t, float& u, float& v )
+{
+	const __m128 ox = _mm_set1_ps( org[0] ), oy = _mm_set1_ps( org[1] ), oz = _mm_set1_ps( org[2] );
+	const __m128 dx = _mm_set1_ps( dir[0] ), dy = _mm_set1_ps( dir[1] ), dz = _mm_set1_ps( dir[2] );
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps( 1.0f );
+	const __m128 eps = _mm_set1_ps( TRI_EPSILON );
+
+	int hit = -1;
+	float ts[4], us[4], vs[4];
+
+	for( int k = first; k < first + count; k += 4 ) {
+		const float *f = tris + k;
+		__m128 e1x = _mm_loadu_ps( f + TRI_E1X*stride );
+		__m128 e1y = _mm_loadu_ps( f + TRI_E1Y*stride );
+		__m128 e1z = _mm_loadu_ps( f + TRI_E1Z*stride );
+		__m128 e2x = _mm_loadu_ps( f + TRI_E2X*stride );
+		__m128 e2y = _mm_loadu_ps( f + TRI_E2Y*stride );
+		__m128 e2z = _mm_loadu_ps( f + TRI_E2Z*stride );
+
+		__m128 px = _mm_sub_ps( _mm_mul_ps( dy, e2z ), _mm_mul_ps( dz, e2y ) );
+		__m128 py = _mm_sub_ps( _mm_mul_ps( dz, e2x ), _mm_mul_ps( dx, e2z ) );
+		__m128 pz = _mm_sub_ps( _mm_mul_ps( dx, e2y ), _mm_mul_ps( dy, e2x ) );
+		__m128 det = _mm_add_ps( _mm_add_ps( _mm_mul_ps( e1x, px ), _mm_mul_ps( e1y, py ) ),
+			_mm_mul_ps( e1z, pz ) );
+		__m128 mask = _mm_cmpgt_ps( det, _mm_loadu_ps( f + TRI_MINDET*stride ) );
+		if( !_mm_movemask_ps( mask ) )
+			continue;
+		__m128 inv = _mm_div_ps( one, det );
+
+		__m128 sx = _mm_sub_ps( ox, _mm_loadu_ps( f + TRI_V0X*stride ) );
+		__m128 sy = _mm_sub_ps( oy, _mm_loadu_ps( f + TRI_V0Y*stride ) );
+		__m128 sz = _mm_sub_ps( oz, _mm_loadu_ps( f + TRI_V0Z*stride ) );
+		__m128 uu = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( sx, px ), _mm_mul_ps( sy, py ) ),
+			_mm_mul_ps( sz, pz ) ), inv );
+
+		__m128 qx = _mm_sub_ps( _mm_mul_ps( sy, e1z ), _mm_mul_ps( sz, e1y ) );
+		__m128 qy = _mm_sub_ps( _mm_mul_ps( sz, e1x ), _mm_mul_ps( sx, e1z ) );
+		__m128 qz = _mm_sub_ps( _mm_mul_ps( sx, e1y ), _mm_mul_ps( sy, e1x ) );
+		__m128 vv = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( dx, qx ), _mm_mul_ps( dy, qy ) ),
+			_mm_mul_ps( dz, qz ) ), inv );
+		__m128 tt = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( e2x, qx ), _mm_mul_ps( e2y, qy ) ),
+			_mm_mul_ps( e2z, qz ) ), inv );
+
+		mask = _mm_and_ps( mask, _mm_cmpge_ps( uu, zero ) );
+		mask = _mm_and_ps( mask, _mm_cmpge_ps( vv, zero ) );
+		mask = _mm_and_ps( mask, _mm_cmple_ps( _mm_add_ps( uu, vv ), one ) );
+		mask = _mm_and_ps( mask, _mm_cmpge_ps( tt, eps ) );
+		mask = _mm_and_ps( mask, _mm_cmplt_ps( tt, _mm_set1_ps( tMax ) ) );
+
+		// lanes past the end of the run belong to the next leaf
+		int bits = _mm_movemask_ps( mask );
+		if( first + count - k < 4 )
+			bits &= (1 << (first + count - k)) - 1;
+		if( !bits )
+			continue;
+
+		_mm_storeu_ps( ts, tt );
+		_mm_storeu_ps( us, uu );
+		_mm_storeu_ps( vs, vv );
+		int lane = closestLane( bits, ts, us, vs, k, tMax, t, u, v );
+		if( lane >= 0 )
+			hit = lane;
+	}
+
+	return hit;
+}
+
+TRI_AVX2_FUNC
+static int intersectAVX2( const float *tris, int stride, int first, int count,
+	const float org[3], const float dir[3], float tMax,
+	float& t, float& u, float& v )
+{
+	const __m256 ox = _mm256_set1_ps( org[0] ), oy = _mm256_set1_ps( org[1] ), oz = _mm256_set1_ps( org[2] );
+	const __m256 dx = _mm256_set1_ps( dir[0] ), dy = _mm256_set1_ps( dir[1] ), dz = _mm256_set1_ps( dir[2] );
+	const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps( 1.0f );
+	const __m256 eps = _mm256_set1_ps( TRI_EPSILON );
+
+	int hit = -1;
+	float ts[8], us[8], vs[8];
+
+	for( int k = first; k < first + count; k += 8 ) {
+		const float *f = tris + k;
+		__m256 e1x = _mm256_loadu_ps( f + TRI_E1X*stride );
+		__m256 e1y = _mm256_loadu_ps( f + TRI_E1Y*stride );
+		__m256 e1z = _mm256_loadu_ps( f + TRI_E1Z*stride );
+		__m256 e2x = _mm256_loadu_ps( f + TRI_E2X*stride );
+		__m256 e2y = _mm256_loadu_ps( f + TRI_E2Y*stride );
+		__m256 e2z = _mm256_loadu_ps( f + TRI_E2Z*stride );
+
+		__m256 px = _mm256_sub_ps( _mm256_mul_ps( dy, e2z ), _mm256_mul_ps( dz, e2y ) );
+		__m256 py = _mm256_sub_ps( _mm256_mul_ps( dz, e2x ), _mm256_mul_ps( dx, e2z ) );
+		__m256 pz = _mm256_sub_ps( _mm256_mul_ps( dx, e2y ), _mm256_mul_ps( dy, e2x ) );
+		__m256 det = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( e1x, px ), _mm256_mul_ps( e1y, py ) ),
+			_mm256_mul_ps( e1z, pz ) );
+		__m256 mask = _mm256_cmp_ps( det, _mm256_loadu_ps( f + TRI_MINDET*stride ), _CMP_GT_OQ );
+		if( !_mm256_movemask_ps( mask ) )
+			continue;
+		__m256 inv = _mm256_div_ps( one, det );
+
+		__m256 sx = _mm256_sub_ps( ox, _mm256_loadu_ps( f + TRI_V0X*stride ) );
+		__m256 sy = _mm256_sub_ps( oy, _mm256_loadu_ps( f + TRI_V0Y*stride ) );
+		__m256 sz = _mm256_sub_ps( oz, _mm256_loadu_ps( f + TRI_V0Z*stride ) );
+		__m256 uu = _mm256_mul_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( sx, px ), _mm256_mul_ps( sy, py ) ),
+			_mm256_mul_ps( sz, pz ) ), inv );
+
+		__m256 qx = _mm256_sub_ps( _mm256_mul_ps( sy, e1z ), _mm256_mul_ps( sz, e1y ) );
+		__m256 qy = _mm256_sub_ps( _mm256_mul_ps( sz, e1x ), _mm256_mul_ps( sx, e1z ) );
+		__m256 qz = _mm256_sub_ps( _mm256_mul_ps( sx, e1y ), _mm256_mul_ps( sy, e1x ) );
+		__m256 vv = _mm256_mul_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( dx, qx ), _mm256_mul_ps( dy, qy ) ),
+			_mm256_mul_ps( dz, qz ) ), inv );
+		__m256 tt = _mm256_mul_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( e2x, qx ), _mm256_mul_ps( e2y, qy ) ),
+			_mm256_mul_ps( e2z, qz ) ), inv );
+
+		mask = _mm256_and_ps( mask, _mm256_cmp_ps( uu, zero, _CMP_GE_OQ ) );
+		mask = _mm256_and_ps( mask, _mm256_cmp_ps( vv, zero, _CMP_GE_OQ ) );
+		mask = _mm256_and_ps( mask, _mm256_cmp_ps( _mm256_add_ps( uu, vv ), one, _CMP_LE_OQ ) );
+		mask = _mm256_and_ps( mask, _mm256_cmp_ps( tt, eps, _CMP_GE_OQ ) );
+		mask = _mm256_and_ps( mask, _mm256_cmp_ps( tt, _mm256_set1_ps( tMax ), _CMP_LT_OQ ) );
+
+		int bits = _mm256_movemask_ps( mask );
+		if( first + count - k < 8 )
+			bits &= (1 << (first + count - k)) - 1;
+		if( !bits )
+			continue;
+
+		_mm256_storeu_ps( ts, tt );
+		_mm256_storeu_ps( us, uu );
+		_mm256_storeu_ps( vs, vv );
+		int lane = closestLane( bits, ts, us, vs, k, tMax, t, u, v );
+		if( lane >= 0 )
+			hit = lane;
+	}
+
+	return hit;
+}
+
+// AVX2 needs both the instructions and an OS that saves the ymm state.
+static bool cpuHasAVX2()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid( info, 0 );
+	if( info[0] < 7 )
+		return false;
+	__cpuid( info, 1 );
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if( !osxsave || !avx || (_xgetbv( 0 ) & 6) != 6 )
+		return false;
+	__cpuidex( info, 7, 0 );
+	return (info[1] & (1 << 5)) != 0;
+#elif defined(__GNUC__)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports( "avx2" ) != 0;
+#else
+	return false;
+#endif
+}
+
+#endif // TRI_X86
+
+struct KernelChoice
+{
+	TriangleKernel kernel;
+	int width;
+
+	KernelChoice()
+	{
+#ifdef TRI_X86
+		if( cpuHasAVX2() ) {
+			kernel = intersectAVX2;
+			width = 8;
+		} else {
+			kernel = intersectSSE;
+			width = 4;
+		}
+#else
+		kernel = intersectScalar;
+		width = 1;
+#endif
+	}
+};
+
+static const KernelChoice& kernelChoice()
+{
+	static KernelChoice choice;
+	return choice;
+}
+
+TriangleKernel triangleKernel()
+{
+	return kernelChoice().kernel;
+}
+
+int triangleKernelWidth()
+{
+	return kernelChoice().width;
+}
@@ -0,0 +1,43 @@
+//
+// trikernel.h
+//
+// Möller–Trumbore ray/triangle tests over a run of triangles at once.
+// The triangles are kept as a structure of arrays, TRI_FIELDS blocks of
+// 'stride' floats each (see the TRI_* field indices), so that SSE and
+// AVX2 kernels can load 4 or 8 triangles per field with a single load.
+// The kernel is chosen once at run time from what the CPU supports;
+// there is always a scalar fallback.
+//
+
+#ifndef __TRIKERNEL_H__
+#define __TRIKERNEL_H__
+
+// Field blocks of the triangle arrays.  e1 = b - a, e2 = c - a, and
+// minDet is NORMAL_EPSILON * |e1 x e2|: a face is only hit from the
+// side its normal points to, and only if the ray isn't too grazing.
+enum {
+	TRI_V0X, TRI_V0Y, TRI_V0Z,
+	TRI_E1X, TRI_E1Y, TRI_E1Z,
+	TRI_E2X, TRI_E2Y, TRI_E2Z,
+	TRI_MINDET,
+	TRI_FIELDS
+};
+
+// Arrays must have room for this many triangles past the last one, all
+// zero, so the widest kernel can load a whole batch at the end.
+const int TRI_PADDING = 8;
+
+// Find the closest hit among triangles [first, first+count) of the
+// arrays in tris, closer than tMax and no closer than RAY_EPSILON.
+// Returns the index of the triangle hit and fills in t and the
+// barycentric weights u (of b) and v (of c), or returns -1.
+typedef int (*TriangleKernel)( const float *tris, int stride, int first, int count,
+	const float org[3], const float dir[3], float tMax,
+	float& t, float& u, float& v );
+
+// The best kernel for this machine, and how many triangles it tests
+// at once.
+TriangleKernel triangleKernel();
+int triangleKernelWidth();
+
+#endif // __TRIKERNEL_H__
@@ -1,8 +1,9 @@
 #include <cmath>
 #include <float.h>
 #include "trimesh.h"
+#include "../RenderStats.h"
 
-Trimesh::~Trimesh()
+Trimesh::Shape::~Shape()
 {
     for( Materials::iterator i = materials.begin(); i != materials.end(); ++i )
     {
@@ -10,34 +11,43 @@ Trimesh::~Trimesh()
     }
 }
 
+Trimesh::~Trimesh()
+{
+    if( --shape->refs == 0 )
+        delete shape;
+}
+
 // must add vertices, normals, and materials IN ORDER
 void Trimesh::addVertex( const vec3f &v )
 {
-    vertices.push_back( v );
+    shape->positions.push_back( (float)v[0] );
+    shape->positions.push_back( (float)v[1] );
+    shape->positions.push_back( (float)v[2] );
 }
 
 void Trimesh::addMaterial( Material *m )
 {
-    materials.push_back( m );
+    shape->materials.push_back( m );
 }
 
 void Trimesh::addNormal( const vec3f &n )
 {
-    normals.push_back( n );
+    shape->normals.push_back( (float)n[0] );
+    shape->normals.push_back( (float)n[1] );
+    shape->normals.push_back( (float)n[2] );
 }
 
 // Returns false if the vertices a,b,c don't all exist
 bool Trimesh::addFace( int a, int b, int c )
 {
-    int vcnt = vertices.size();
+    int vcnt = vertexCount();
 
     if( a >= vcnt || b >= vcnt || c >= vcnt )
         return false;
 
-    TrimeshFace *newFace = new TrimeshFace( scene, new Material(*this->material), this, a, b, c );
-    newFace->setTransform(this->transform);
-    faces.push_back( newFace );
-    scene->add(newFace);
+    shape->indices.push_back( a );
+    shape->indices.push_back( b );
+    shape->indices.push_back( c );
     return true;
 }
 
@@ -46,100 +56,236 @@ Trimesh::doubleCheck()
 // Check to make sure that if we have per-vertex materials or normals
 // they are the right number.
 {
-    if( materials.size() && materials.size() != vertices.size() )
+    if( shape->materials.size() && (int)shape->materials.size() != vertexCount() )
         return "Bad Trimesh: Wrong number of materials.";
-    if( normals.size() && normals.size() != vertices.size() )
+    if( shape->normals.size() && shape->normals.size() != shape->positions.size() )
         return "Bad Trimesh: Wrong number of normals.";
 
     return 0;
 }
 
-// Intersect ray r with the triangle abc.  If it hits returns true,
-// and put the parameter in t and the barycentric coordinates of the
-// intersection in bary.
-// Uses the algorithm and notation from _Graphic Gems 5_, p. 232.
-//
-// Calculates and returns the normal of the triangle too.
-bool TrimeshFace::intersectLocal( const ray& r, isect& i ) const
-{
-    const vec3f& a = parent->vertices[ids[0]];
-    const vec3f& b = parent->vertices[ids[1]];
-    const vec3f& c = parent->vertices[ids[2]];
-    
-    vec3f bary;
-    float t;
-    vec3f n;
-    
-    vec3f p = r.getPosition();
-    vec3f v = r.getDirection();
-    
-    vec3f ab = b - a;
-    vec3f ac = c - a;
-    vec3f ap = p - a;
-    
-	vec3f cv=ab.cross(ac);
-
-	// there exists some bad triangles such that two vertices coincide
-	// check this before normalize
-	if (cv.iszero()) return false;
-    n = (cv).normalize();
-	
-    double vdotn = v*n;
-    if( -vdotn < NORMAL_EPSILON )
-        return false;
-    
-    t = - (ap*n)/vdotn;
-    
-    if( t < RAY_EPSILON )
-        return false;
+void Trimesh::build()
+{
+    Indices& indices = shape->indices;
+    vector<float>& triangles = shape->triangles;
+    int cnt = faceCount();
+
+    vector<BoundingBox> boxes( cnt );
+    for( int f = 0; f < cnt; ++f )
+    {
+        vec3f a = vertex( indices[3*f] );
+        vec3f b = vertex( indices[3*f+1] );
+        vec3f c = vertex( indices[3*f+2] );
+        boxes[f].min = minimum( minimum( a, b ), c );
+        boxes[f].max = maximum( maximum( a, b ), c );
+    }
+
+    vector<int> order;
+    shape->bvh.build( boxes, order, triangleKernelWidth() );
+
+    // store the faces in leaf order, so a leaf covers a contiguous run
+    Indices sorted( indices.size() );
+    for( int k = 0; k < cnt; ++k )
+    {
+        for( int j = 0; j < 3; ++j )
+            sorted[3*k+j] = indices[3*order[k]+j];
+    }
+    indices.swap( sorted );
+
+    // precompute the kernel's view of every face; the padding stays zero,
+    // which the kernel treats as a miss
+    int triStride = shape->triStride = cnt + TRI_PADDING;
+    triangles.assign( TRI_FIELDS * triStride, 0.0f );
+    for( int f = 0; f < cnt; ++f )
+    {
+        vec3f a = vertex( indices[3*f] );
+        vec3f e1 = vertex( indices[3*f+1] ) - a;
+        vec3f e2 = vertex( indices[3*f+2] ) - a;
+        vec3f n = e1.cross( e2 );
+        for( int j = 0; j < 3; ++j )
+        {
+            triangles[(TRI_V0X+j)*triStride + f] = (float)a[j];
+            triangles[(TRI_E1X+j)*triStride + f] = (float)e1[j];
+            triangles[(TRI_E2X+j)*triStride + f] = (float)e2[j];
+        }
+        triangles[TRI_MINDET*triStride + f] = (float)(NORMAL_EPSILON * n.length());
+    }
+}
+
+// Worked out once per shape, however many instances there are.
+BoundingBox Trimesh::ComputeLocalBoundingBox()
+{
+    const Indices& indices = shape->indices;
+    if( !shape->bounded && !indices.empty() )
+    {
+        BoundingBox& localbounds = shape->bounds;
+        localbounds.min = localbounds.max = vertex( indices[0] );
+        for( int k = 1; k < (int)indices.size(); ++k )
+            localbounds.merge( vertex( indices[k] ) );
+        shape->bounded = true;
+    }
+    return shape->bounds;
+}
+
+// The bounds of the vertices in world space, which for a rotated mesh
+// can be far tighter than its transformed local box.
+void Trimesh::ComputeBoundingBox()
+{
+    BoundingBox local = ComputeLocalBoundingBox();
+    switch( transform->getKind() )
+    {
+    case TransformNode::IDENTITY:
+        bounds = local;
+        return;
+
+    case TransformNode::TRANSLATE:
+        bounds.min = local.min + transform->getTranslation();
+        bounds.max = local.max + transform->getTranslation();
+        return;
+
+    default:
+        break;
+    }
+
+    const Indices& indices = shape->indices;
+    if( indices.empty() )
+    {
+        bounds = transformBox( local );
+        return;
+    }
 
-    // find k where k is the index of the component
-    // of normal vector with greatest absolute value
-    float greatestMag = FLT_MIN;
-    int k = -1;
-    for( int j = 0; j < 3; ++j )
+    // only the vertices that faces use count, as for the local bounds
+    vector<bool> used( vertexCount() );
+    for( int k = 0; k < (int)indices.size(); ++k )
+        used[ indices[k] ] = true;
+
+    bool first = true;
+    for( int v = 0; v < vertexCount(); ++v )
     {
-        float val = n[j];
-        if( val < 0 )
-            val *= -1;
-        if( val > greatestMag )
+        if( !used[v] )
+            continue;
+        vec3f p = transform->localToGlobalCoords( vertex( v ) );
+        if( first )
+            bounds.min = bounds.max = p;
+        else
+            bounds.merge( p );
+        first = false;
+    }
+}
+
+// Closest-hit visitor for the face hierarchy: runs the triangle kernel
+// over each leaf's run of faces.
+struct Trimesh::HitVisitor
+{
+    const Trimesh& mesh;
+    TriangleKernel kernel;
+    float org[3];
+    float dir[3];
+    int face;
+    float t, u, v;
+
+    HitVisitor( const Trimesh& m, const ray& r )
+        : mesh( m ), kernel( triangleKernel() ), face( -1 )
+    {
+        vec3f p = r.getPosition();
+        vec3f d = r.getDirection();
+        for( int j = 0; j < 3; ++j )
         {
-            k = j;
-            greatestMag = val;
+            org[j] = (float)p[j];
+            dir[j] = (float)d[j];
         }
     }
 
-    vec3f am = ap + t * v;
-    
-	bary[1] = (am.cross(ac))[k]/(ab.cross(ac))[k];
-    bary[2] = (ab.cross(am))[k]/(ab.cross(ac))[k];
-    bary[0] = 1-bary[1]-bary[2];
-    if( bary[0] < 0 || bary[1] < 0 || bary[1] > 1 || bary[2] < 0 || bary[2] > 1 )
+    bool operator()( int first, int count, double& tMax )
+    {
+        STAT_ADD( triangleTests, count );
+        int f = kernel( &mesh.shape->triangles[0], mesh.shape->triStride, first, count,
+            org, dir, (float)tMax, t, u, v );
+        if( f < 0 )
+            return false;
+        face = f;
+        tMax = t;
+        return true;
+    }
+};
+
+bool Trimesh::intersectLocal( const ray& r, isect& i ) const
+{
+    HitVisitor visit( *this, r );
+    if( !shape->bvh.traverseLeaves( r, 1.0e308, visit ) )
         return false;
 
     // if we get this far, we have an intersection.  Fill in the info.
-    i.setT( t );
-    if(parent->normals.size())
+    const int *ids = &shape->indices[3*visit.face];
+    vec3f bary( 1.0 - visit.u - visit.v, visit.u, visit.v );
+
+    i.setT( visit.t );
+    if( shape->normals.size() )
     {
         // use interpolated normals
-        i.setN( (bary[0] * parent->normals[ids[0]]
-                 + bary[1] * parent->normals[ids[1]]
-                 + bary[2] * parent->normals[ids[2]]).normalize() );
+        i.setN( (bary[0] * normal( ids[0] )
+                 + bary[1] * normal( ids[1] )
+                 + bary[2] * normal( ids[2] )).normalize() );
     } else {
-        i.setN( n );           // use face normal
+        // use face normal
+        vec3f a = vertex( ids[0] );
+        i.setN( ((vertex( ids[1] ) - a).cross( vertex( ids[2] ) - a)).normalize() );
     }
     i.obj = this;
+    i.setBary( bary );
+    i.setFace( visit.face );
 
-    // linearly interpolate materials
-    if( parent->materials.size() )
+    return true;
+}
+
+// Any-hit visitor for the face hierarchy: a leaf blocks the ray if the
+// kernel finds any face in it before tMax.
+struct Trimesh::AnyHitVisitor
+{
+    const Trimesh& mesh;
+    TriangleKernel kernel;
+    float org[3];
+    float dir[3];
+
+    AnyHitVisitor( const Trimesh& m, const ray& r )
+        : mesh( m ), kernel( triangleKernel() )
     {
-        Material *m = new Material();
-        for( int jj = 0; jj < 3; ++jj )
-            (*m) += bary[jj] * (*parent->materials[ ids[jj] ]);
-        i.setMaterial( m );
+        vec3f p = r.getPosition();
+        vec3f d = r.getDirection();
+        for( int j = 0; j < 3; ++j )
+        {
+            org[j] = (float)p[j];
+            dir[j] = (float)d[j];
+        }
     }
-    
-    return true;
+
+    bool operator()( int first, int count, double& tMax )
+    {
+        float t, u, v;
+        STAT_ADD( triangleTests, count );
+        return kernel( &mesh.shape->triangles[0], mesh.shape->triStride, first, count,
+            org, dir, (float)tMax, t, u, v ) >= 0;
+    }
+};
+
+bool Trimesh::occludedLocal( const ray& r, double tMax ) const
+{
+    AnyHitVisitor visit( *this, r );
+    return shape->bvh.traverseAnyLeaves( r, tMax, visit );
+}
+
+// Per-vertex materials are only interpolated here, once the closest hit
+// is known, rather than for every candidate hit in intersectLocal.
+Material Trimesh::getMaterial( const isect& i ) const
+{
+    if( !shape->materials.size() || i.face < 0 )
+        return getMaterial();
+
+    const int *ids = &shape->indices[3*i.face];
+    Material m;
+    for( int jj = 0; jj < 3; ++jj )
+        m += i.bary[jj] * (*shape->materials[ ids[jj] ]);
+    return m;
 }
 
 void
@@ -147,32 +293,36 @@ Trimesh::generateNormals()
 // Once you've loaded all the verts and faces, we can generate per
 // vertex normals by averaging the normals of the neighboring faces.
 {
-    int cnt = vertices.size();
-    normals.resize( cnt );
+    int cnt = vertexCount();
+    vector<vec3f> sums( cnt );
     int *numFaces = new int[ cnt ]; // the number of faces assoc. with each vertex
     memset( numFaces, 0, sizeof(int)*cnt );
-    
-    for( Faces::iterator fi = faces.begin(); fi != faces.end(); ++fi )
+
+    for( int f = 0; f < faceCount(); ++f )
     {
-        vec3f a = vertices[(**fi)[0]];
-        vec3f b = vertices[(**fi)[1]];
-        vec3f c = vertices[(**fi)[2]];
-        
+        const int *ids = &shape->indices[3*f];
+        vec3f a = vertex( ids[0] );
+        vec3f b = vertex( ids[1] );
+        vec3f c = vertex( ids[2] );
+
         vec3f faceNormal = ((b-a).cross(c-a)).normalize();
-        
+
         for( int i = 0; i < 3; ++i )
         {
-            normals[(**fi)[i]] += faceNormal;
-            ++numFaces[(**fi)[i]];
+            sums[ids[i]] += faceNormal;
+            ++numFaces[ids[i]];
         }
     }
 
     for( int i = 0; i < cnt; ++i )
     {
         if( numFaces[i] )
-            normals[i]  /= numFaces[i];
+            sums[i]  /= numFaces[i];
     }
 
+    shape->normals.clear();
+    for( int i = 0; i < cnt; ++i )
+        addNormal( sums[i] );
+
     delete [] numFaces;
 }
-
@@ -7,29 +7,76 @@
 #include "../scene/ray.h"
 #include "../scene/material.h"
 #include "../scene/scene.h"
-class TrimeshFace;
+#include "../scene/bvh.h"
+#include "trikernel.h"
+
+// A triangle mesh is a single object in the scene.  Its vertex positions,
+// normals and face indices live in flat single-precision buffers (three
+// entries per vertex or face), and the faces are found through a BVH of
+// their own, built in object space by build() once the mesh is complete.
+// Faces are stored in the leaf order of that BVH, and build() also lays
+// them out for the SIMD triangle kernel (see trikernel.h).
+//
+// All of that is the mesh's Shape, which instances of the mesh share: an
+// instance is a Trimesh with a transform and material of its own and a
+// reference to another mesh's shape, so a mesh placed many times is only
+// stored once.  The scene's hierarchy is built over the instances, and a
+// ray goes into an instance's object space once, on the way in.
 
 class Trimesh : public MaterialSceneObject
 {
-    friend class TrimeshFace;
-    typedef vector<vec3f> Normals;
-    typedef vector<vec3f> Vertices;
-    typedef vector<TrimeshFace*> Faces;
+    typedef vector<float> Positions;
+    typedef vector<float> Normals;
+    typedef vector<int> Indices;
     typedef vector<Material*> Materials;
-    Vertices vertices;
-    Faces faces;
-    Normals normals;
-    Materials materials;
+
+    struct Shape
+    {
+        Positions positions;
+        Normals normals;
+        Indices indices;
+        Materials materials;
+        BVH bvh;
+
+        // TRI_FIELDS blocks of triStride floats, in leaf order
+        vector<float> triangles;
+        int triStride;
+
+        // the object space bounds, once ComputeLocalBoundingBox() has found them
+        BoundingBox bounds;
+        bool bounded;
+
+        int refs;       // the meshes using this shape
+
+        Shape() : triStride( 0 ), bounded( false ), refs( 1 ) {}
+        ~Shape();
+    };
+    Shape *shape;
+
+    struct HitVisitor;
+    struct AnyHitVisitor;
+    friend class SceneCache;
 public:
     Trimesh( Scene *scene, Material *mat, TransformNode *transform )
-        : MaterialSceneObject(scene, mat)
+        : MaterialSceneObject(scene, mat), shape( new Shape )
+    {
+        this->transform = transform;
+    }
+
+    // An instance of mesh: the same faces, placed by transform and
+    // drawn in mat (unless mesh has per-vertex materials).  mesh should
+    // be built already.
+    Trimesh( Scene *scene, Material *mat, TransformNode *transform, const Trimesh& mesh )
+        : MaterialSceneObject(scene, mat), shape( mesh.shape )
     {
         this->transform = transform;
+        ++shape->refs;
     }
 
     ~Trimesh();
-    
-    // must add vertices, normals, and materials IN ORDER
+
+    // must add vertices, normals, and materials IN ORDER, and only
+    // before the mesh is instanced
     void addVertex( const vec3f & );
     void addMaterial( Material *m );
     void addNormal( const vec3f & );
@@ -37,44 +84,38 @@ public:
     bool addFace( int a, int b, int c );
 
     char *doubleCheck();
-    
+
     void generateNormals();
-};
 
-class TrimeshFace : public MaterialSceneObject
-{
-    Trimesh *parent;
-    int ids[3];
-public:
-    TrimeshFace( Scene *scene, Material *mat, Trimesh *parent, int a, int b, int c)
-        : MaterialSceneObject( scene, mat )
-    {
-        this->parent = parent;
-        ids[0] = a;
-        ids[1] = b;
-        ids[2] = c;
-    }
+    // Build the face hierarchy; call once every face has been added.
+    void build();
 
-    int operator[]( int i ) const
-    {
-        return ids[i];
-    }
+    int vertexCount() const { return (int)shape->positions.size() / 3; }
+    int faceCount() const { return (int)shape->indices.size() / 3; }
+    bool hasVertexMaterials() const { return !shape->materials.empty(); }
 
     virtual bool intersectLocal( const ray& r, isect& i ) const;
+    virtual bool occludedLocal( const ray& r, double tMax ) const;
+
+    // linearly interpolates the per-vertex materials, if there are any
+    using MaterialSceneObject::getMaterial;
+    virtual Material getMaterial( const isect& i ) const;
 
     virtual bool hasBoundingBoxCapability() const { return true; }
-      
-    virtual BoundingBox ComputeLocalBoundingBox()
+    virtual void ComputeBoundingBox();
+    virtual BoundingBox ComputeLocalBoundingBox();
+
+private:
+    vec3f vertex( int v ) const
+    {
+        const float *p = &shape->positions[3*v];
+        return vec3f( p[0], p[1], p[2] );
+    }
+    vec3f normal( int v ) const
     {
-        BoundingBox localbounds;
-        localbounds.max = maximum( parent->vertices[ids[0]], parent->vertices[ids[1]]);
-		localbounds.min = minimum( parent->vertices[ids[0]], parent->vertices[ids[1]]);
-        
-        localbounds.max = maximum( parent->vertices[ids[2]], localbounds.max);
-		localbounds.min = minimum( parent->vertices[ids[2]], localbounds.min);
-        return localbounds;
+        const float *n = &shape->normals[3*v];
+        return vec3f( n[0], n[1], n[2] );
     }
-    
 };
 
 
@@ -0,0 +1,134 @@
+#include "ThreadPool.h"
+
+struct ThreadPool::Batch
+{
+	const function<void(int)> *body;
+	atomic<int> remaining;
+	mutex lock;
+	condition_variable done;
+};
+
+ThreadPool::ThreadPool( int threads )
+	: pending( 0 ), stopping( false ), nextQueue( 0 )
+{
+	if( threads <= 0 )
+		threads = hardwareThreads();
+
+	for( int i = 0; i < threads; ++i )
+		queues.push_back( new Queue );
+	for( int i = 0; i < threads; ++i )
+		workers.push_back( thread( &ThreadPool::workerLoop, this, i ) );
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		lock_guard<mutex> guard( sleepLock );
+		stopping = true;
+	}
+	wake.notify_all();
+
+	for( int i = 0; i < (int)workers.size(); ++i )
+		workers[i].join();
+	for( int i = 0; i < (int)queues.size(); ++i )
+		delete queues[i];
+}
+
+int ThreadPool::hardwareThreads()
+{
+	int n = (int)thread::hardware_concurrency();
+	return n > 0 ? n : 1;
+}
+
+void ThreadPool::parallelFor( int count, const function<void(int)>& body )
+{
+	if( count <= 0 )
+		return;
+
+	Batch batch;
+	batch.body = &body;
+	batch.remaining = count;
+
+	// deal the tasks out round-robin; stealing evens out the rest.
+	{
+		lock_guard<mutex> guard( sleepLock );
+		pending += count;
+		int q = nextQueue;
+		for( int k = 0; k < count; ++k ) {
+			Task task = { &batch, k };
+			Queue *queue = queues[ q ];
+			{
+				lock_guard<mutex> qguard( queue->lock );
+				queue->tasks.push_back( task );
+			}
+			q = (q + 1) % (int)queues.size();
+		}
+		nextQueue = q;
+	}
+	wake.notify_all();
+
+	unique_lock<mutex> guard( batch.lock );
+	while( batch.remaining > 0 )
+		batch.done.wait( guard );
+}
+
+bool ThreadPool::popTask( int self, Task& task )
+{
+	int n = (int)queues.size();
+
+	// own queue first, newest task...
+	{
+		Queue *queue = queues[ self ];
+		lock_guard<mutex> guard( queue->lock );
+		if( !queue->tasks.empty() ) {
+			task = queue->tasks.back();
+			queue->tasks.pop_back();
+			--pending;
+			return true;
+		}
+	}
+
+	// ...then steal the oldest task of someone else.
+	for( int i = 1; i < n; ++i ) {
+		Queue *queue = queues[ (self + i) % n ];
+		lock_guard<mutex> guard( queue->lock );
+		if( !queue->tasks.empty() ) {
+			task = queue->tasks.front();
+			queue->tasks.pop_front();
+			--pending;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void ThreadPool::runTask( const Task& task )
+{
+	Batch *batch = task.batch;
+	(*batch->body)( task.index );
+
+	// the count only drops under the lock, so the caller can't see the
+	// batch finish (and destroy it) while we still hold a reference.
+	lock_guard<mutex> guard( batch->lock );
+	if( --batch->remaining == 0 )
+		batch->done.notify_all();
+}
+
+void ThreadPool::workerLoop( int self )
+{
+	Task task;
+
+	while( true ) {
+		if( popTask( self, task ) ) {
+			runTask( task );
+			continue;
+		}
+
+		unique_lock<mutex> guard( sleepLock );
+		while( !stopping && pending == 0 )
+			wake.wait( guard );
+		if( stopping && pending == 0 )
+			return;
+	}
+}
@@ -0,0 +1,64 @@
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+// A fixed set of worker threads with per-worker task queues.  A worker
+// takes tasks from the back of its own queue and, once that is empty,
+// steals from the front of the other workers' queues, so uneven tiles
+// keep every core busy until the whole batch is done.
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+using namespace std;
+
+class ThreadPool
+{
+public:
+	// threads <= 0 means one worker per hardware thread.
+	explicit ThreadPool( int threads = 0 );
+	~ThreadPool();
+
+	int size() const { return (int)workers.size(); }
+
+	// Call body( k ) for every k in [0,count) on the workers and wait
+	// until all of them have returned.  Several threads may call this
+	// at once; their batches share the workers.
+	void parallelFor( int count, const function<void(int)>& body );
+
+	static int hardwareThreads();
+
+private:
+	struct Batch;
+
+	struct Task
+	{
+		Batch *batch;
+		int index;
+	};
+
+	struct Queue
+	{
+		mutex lock;
+		deque<Task> tasks;
+	};
+
+	void workerLoop( int self );
+	bool popTask( int self, Task& task );
+	void runTask( const Task& task );
+
+	vector<thread> workers;
+	vector<Queue*> queues;
+
+	mutex sleepLock;
+	condition_variable wake;
+	atomic<int> pending;		// tasks queued but not yet taken
+	bool stopping;
+	int nextQueue;
+};
+
+#endif // __THREADPOOL_H__
@@ -0,0 +1,49 @@
+#include <math.h>
+
+#include "ToneMap.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define TONE_X86
+#include <emmintrin.h>
+#endif
+
+// The channels are all mapped alike, so the pixels are just a run of
+// 3 * count floats.  The comparisons are written so that NaNs come out
+// as 0 and infinities as 255, the same in both loops.
+void ToneMap::apply( const float *radiance, unsigned char *pixels, int count ) const
+{
+	const float scale = (float)pow( 2.0, exposure );
+	const bool reinhard = curve == REINHARD;
+	const int n = count * 3;
+	int k = 0;
+
+#ifdef TONE_X86
+	// 16 channels at a time: four vectors of floats, truncated to ints
+	// and packed down to 16 bytes.
+	const __m128 s = _mm_set1_ps( scale );
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps( 1.0f );
+	const __m128 full = _mm_set1_ps( 255.0f );
+	for( ; k + 16 <= n; k += 16 ) {
+		__m128i q[4];
+		for( int l = 0; l < 4; ++l ) {
+			__m128 v = _mm_max_ps( _mm_mul_ps( _mm_loadu_ps( radiance + k + 4*l ), s ), zero );
+			if( reinhard )
+				v = _mm_div_ps( v, _mm_add_ps( v, one ) );
+			v = _mm_min_ps( v, one );
+			q[l] = _mm_cvttps_epi32( _mm_mul_ps( v, full ) );
+		}
+		__m128i lo = _mm_packs_epi32( q[0], q[1] );
+		__m128i hi = _mm_packs_epi32( q[2], q[3] );
+		_mm_storeu_si128( (__m128i*)(pixels + k), _mm_packus_epi16( lo, hi ) );
+	}
+#endif
+
+	for( ; k < n; ++k ) {
+		float v = radiance[k] * scale;
+		v = v > 0.0f ? v : 0.0f;
+		if( reinhard )
+			v = v / ( v + 1.0f );
+		v = v < 1.0f ? v : 1.0f;
+		pixels[k] = (unsigned char)(int)( v * 255.0f );
+	}
+}
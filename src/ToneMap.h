@@ -0,0 +1,30 @@
+#ifndef __TONEMAP_H__
+#define __TONEMAP_H__
+
+// Turns the floating point radiance the tracer renders into 8 bit
+// pixels, for display and for the 8 bit image formats.  The radiance is
+// kept, so the exposure or the curve can be changed and the image
+// mapped again without tracing a single ray.
+
+class ToneMap
+{
+public:
+	enum Curve
+	{
+		CLAMP,			// clip at 1, as the tracer always has
+		REINHARD		// c / (1 + c): bright colours roll off instead of clipping
+	};
+
+	ToneMap( Curve curve = CLAMP, double exposure = 0.0 )
+		: curve( curve ), exposure( exposure ) {}
+
+	// Map count RGB pixels of radiance to 8 bit pixels: scale by
+	// 2^exposure, apply the curve and quantize, truncating.  With the
+	// defaults this is exactly what the tracer used to write directly.
+	void apply( const float *radiance, unsigned char *pixels, int count ) const;
+
+	Curve curve;
+	double exposure;	// in stops
+};
+
+#endif // __TONEMAP_H__
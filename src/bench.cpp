@@ -0,0 +1,330 @@
+// A standalone render benchmark.  It renders every .ray file in a samples
+// directory, plus a few generated stress scenes, at a fixed resolution
+// and prints one JSON record per scene: load and render wall time, rays
+// per second, object intersection tests per ray and the share of them
+// that hit, and the peak resident set size of the process so far, along with the work counters of
+// RenderStats.  Comparing the output of two builds
+// shows performance regressions.
+//
+// usage: bench [-w width] [-p threads] [-n runs] [-o out.json] [samples]
+//
+// The counters need RAY_STATS, which the bench project defines; without
+// it the ray and test counts come out as zero.
+
+#ifdef WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "RayTracer.h"
+#include "RenderStats.h"
+
+extern int getopt(int argc, char **argv, char *optstring);
+extern char* optarg;
+extern int optind;
+
+using namespace std;
+
+static int g_width = 512;
+static int g_threads = 0;
+static int g_runs = 3;
+
+struct BenchScene
+{
+	string name;
+	string path;		// empty for generated scenes
+	string text;		// the generated scene
+};
+
+struct BenchResult
+{
+	string name;
+	int width, height;
+	double loadMs, renderMs;
+	RenderStats stats;
+	double peakRSS;
+};
+
+static double elapsedMs( chrono::steady_clock::time_point start )
+{
+	return chrono::duration<double, milli>( chrono::steady_clock::now() - start ).count();
+}
+
+// peak resident set size of the process so far, in megabytes
+static double peakRSSMegabytes()
+{
+#ifdef WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if( !GetProcessMemoryInfo( GetCurrentProcess(), &pmc, sizeof( pmc ) ) )
+		return 0.0;
+	return pmc.PeakWorkingSetSize / 1048576.0;
+#else
+	struct rusage ru;
+	if( getrusage( RUSAGE_SELF, &ru ) )
+		return 0.0;
+#ifdef __APPLE__
+	return ru.ru_maxrss / 1048576.0;		// bytes
+#else
+	return ru.ru_maxrss / 1024.0;			// kilobytes
+#endif
+#endif
+}
+
+static const char *sceneHeader =
+	"SBT-raytracer 1.0\n"
+	"camera { position = (0,0,-4); viewdir = (0,0,1); aspectratio = 1; updir = (0,1,0); }\n"
+	"directional_light { direction = (-1,-1,1); colour = (1,1,1); }\n"
+	"point_light { position = (2,2,-3); colour = (0.5,0.5,0.5); }\n";
+
+// n x n x n small spheres filling the view
+static BenchScene sphereGrid( int n )
+{
+	ostringstream os;
+	os << sceneHeader;
+
+	double step = 3.0 / n;
+	for( int i = 0; i < n; ++i )
+		for( int j = 0; j < n; ++j )
+			for( int k = 0; k < n; ++k ) {
+				os << "translate(" << -1.5 + (i + 0.5) * step << ","
+					<< -1.5 + (j + 0.5) * step << "," << (k + 0.5) * step
+					<< ", scale(" << 0.35 * step << ", sphere { material = { diffuse = ("
+					<< double(i) / n << "," << double(j) / n << "," << double(k) / n
+					<< "); } }))\n";
+			}
+
+	ostringstream name;
+	name << "sphere_grid_" << n;
+	BenchScene s = { name.str(), "", os.str() };
+	return s;
+}
+
+// the points and faces of a unit sphere tessellated into 2 * rings *
+// segments triangles, as the fields of a trimesh
+static void sphereMesh( ostream& os, int rings, int segments )
+{
+	os << "points = (\n";
+
+	const double pi = 3.14159265358979323846;
+	for( int r = 0; r <= rings; ++r ) {
+		double theta = pi * r / rings;
+		for( int s = 0; s < segments; ++s ) {
+			double phi = 2.0 * pi * s / segments;
+			os << "(" << sin( theta ) * cos( phi ) << "," << cos( theta ) << ","
+				<< sin( theta ) * sin( phi ) << ")" << ( r == rings && s == segments - 1 ? "" : "," ) << "\n";
+		}
+	}
+
+	// faces wound so that their normals point out of the sphere
+	os << ");\nfaces = (\n";
+	bool first = true;
+	for( int r = 0; r < rings; ++r ) {
+		for( int s = 0; s < segments; ++s ) {
+			int a = r * segments + s;
+			int b = r * segments + (s + 1) % segments;
+			int c = a + segments;
+			int d = b + segments;
+			os << (first ? "" : ",") << "(" << a << "," << b << "," << c << "),("
+				<< b << "," << d << "," << c << ")\n";
+			first = false;
+		}
+	}
+	os << ");\n";
+}
+
+// a latitude/longitude tessellated sphere with 2 * rings * segments faces
+static BenchScene denseMesh( int rings, int segments )
+{
+	ostringstream os;
+	os << sceneHeader;
+	os << "rotate(1,1,0,0.5, scale(1.5, polymesh {\n"
+		"material = { diffuse = (0.7,0.7,0.9); specular = (0.5,0.5,0.5); shininess = 0.4; };\n";
+	sphereMesh( os, rings, segments );
+	os << "}))\n";
+
+	ostringstream name;
+	name << "dense_mesh_" << 2 * rings * segments;
+	BenchScene s = { name.str(), "", os.str() };
+	return s;
+}
+
+// an n x n grid of copies of one tessellated sphere: the mesh is given
+// once and every other copy is an instance of it
+static BenchScene meshForest( int n, int rings, int segments )
+{
+	ostringstream os;
+	os << sceneHeader;
+
+	double step = 3.0 / n;
+	for( int i = 0; i < n; ++i )
+		for( int j = 0; j < n; ++j ) {
+			os << "translate(" << -1.5 + (i + 0.5) * step << "," << -1.5 + (j + 0.5) * step
+				<< ",1, scale(" << 0.4 * step << ", ";
+			if( i == 0 && j == 0 ) {
+				os << "trimesh { name = \"ball\"; material = { diffuse = (0.7,0.7,0.9); };\n";
+				sphereMesh( os, rings, segments );
+				os << "}))\n";
+			} else {
+				os << "instance { mesh = \"ball\"; material = { diffuse = ("
+					<< double(i) / n << "," << double(j) / n << ",0.9); }; }))\n";
+			}
+		}
+
+	ostringstream name;
+	name << "mesh_forest_" << n * n << "x" << 2 * rings * segments;
+	BenchScene s = { name.str(), "", os.str() };
+	return s;
+}
+
+static bool runScene( const BenchScene& s, BenchResult& result )
+{
+	RayTracer tracer;
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	if( s.path.empty() ) {
+		istringstream is( s.text );
+		tracer.loadScene( is );
+	} else {
+		tracer.loadScene( (char*)s.path.c_str() );
+	}
+	if( !tracer.sceneLoaded() )
+		return false;
+	result.loadMs = elapsedMs( start );
+
+	result.name = s.name;
+	result.width = g_width;
+	result.height = (int)(g_width / tracer.aspectRatio() + 0.5);
+	tracer.traceSetup( result.width, result.height );
+
+	// best of g_runs; the counts are the same every time
+	result.renderMs = 1.0e300;
+	for( int run = 0; run < g_runs; ++run ) {
+		RenderStats::reset();
+		start = chrono::steady_clock::now();
+		if( g_threads == 1 )
+			tracer.traceLines( 0, result.height );
+		else
+			tracer.traceTiles( g_threads );
+		result.renderMs = min( result.renderMs, elapsedMs( start ) );
+	}
+
+	result.stats = RenderStats::total();
+	result.peakRSS = peakRSSMegabytes();
+	return true;
+}
+
+static string jsonString( const string& s )
+{
+	string out = "\"";
+	for( int k = 0; k < (int)s.size(); ++k ) {
+		if( s[k] == '"' || s[k] == '\\' )
+			out += '\\';
+		out += s[k];
+	}
+	return out + "\"";
+}
+
+static void writeJSON( FILE *f, const vector<BenchResult>& results )
+{
+	fprintf( f, "{\n  \"threads\": %d,\n  \"runs\": %d,\n  \"scenes\": [\n",
+		g_threads, g_runs );
+	for( int k = 0; k < (int)results.size(); ++k ) {
+		const BenchResult& r = results[k];
+		const RenderStats& s = r.stats;
+		double seconds = r.renderMs / 1000.0;
+		double rays = s.rays ? double( s.rays ) : 1.0;
+		fprintf( f, "    { \"scene\": %s, \"width\": %d, \"height\": %d, "
+			"\"load_ms\": %.3f, \"render_ms\": %.3f, \"rays\": %llu, "
+			"\"rays_per_sec\": %.0f, \"tests_per_ray\": %.3f, \"box_tests_per_ray\": %.3f, "
+			"\"triangle_tests_per_ray\": %.3f, \"hit_rate\": %.3f, \"object_hit_rate\": %.3f, "
+			"\"peak_rss_mb\": %.1f }%s\n",
+			jsonString( r.name ).c_str(), r.width, r.height, r.loadMs, r.renderMs,
+			s.rays, seconds > 0.0 ? s.rays / seconds : 0.0,
+			s.objectTests / rays, s.boxTests / rays, s.triangleTests / rays,
+			s.hits / rays, s.objectTests ? double( s.objectHits ) / s.objectTests : 0.0, r.peakRSS, k + 1 < (int)results.size() ? "," : "" );
+	}
+	fprintf( f, "  ]\n}\n" );
+}
+
+static void usage( const char *progname )
+{
+	fprintf( stderr, "usage: %s [options] [samples directory]\n", progname );
+	fprintf( stderr, "  -w <#>      image width (default %d)\n", g_width );
+	fprintf( stderr, "  -p <#>      render threads, 0 = all cores (default %d)\n", g_threads );
+	fprintf( stderr, "  -n <#>      renders per scene, the best is reported (default %d)\n", g_runs );
+	fprintf( stderr, "  -o <file>   write the JSON report to file instead of stdout\n" );
+}
+
+int main( int argc, char **argv )
+{
+	const char *outName = NULL;
+	string samples = "simpleSamples";
+
+	int i;
+	while( (i = getopt( argc, argv, (char*)"w:p:n:o:" )) != EOF ) {
+		switch( i ) {
+		case 'w': g_width = atoi( optarg ); break;
+		case 'p': g_threads = atoi( optarg ); break;
+		case 'n': g_runs = max( 1, atoi( optarg ) ); break;
+		case 'o': outName = optarg; break;
+		default:
+			usage( argv[0] );
+			return 1;
+		}
+	}
+	if( optind < argc )
+		samples = argv[optind];
+
+	vector<BenchScene> scenes;
+	vector<string> files;
+	error_code ec;
+	for( filesystem::directory_iterator it( samples, ec ), end; !ec && it != end; ++it ) {
+		if( it->path().extension() == ".ray" )
+			files.push_back( it->path().string() );
+	}
+	sort( files.begin(), files.end() );
+	for( int k = 0; k < (int)files.size(); ++k ) {
+		BenchScene s = { filesystem::path( files[k] ).stem().string(), files[k], "" };
+		scenes.push_back( s );
+	}
+
+	scenes.push_back( sphereGrid( 8 ) );
+	scenes.push_back( sphereGrid( 24 ) );
+	scenes.push_back( denseMesh( 128, 256 ) );
+	scenes.push_back( denseMesh( 512, 1024 ) );
+	scenes.push_back( meshForest( 32, 32, 64 ) );
+
+	vector<BenchResult> results;
+	for( int k = 0; k < (int)scenes.size(); ++k ) {
+		BenchResult r;
+		if( runScene( scenes[k], r ) )
+			results.push_back( r );
+		else
+			fprintf( stderr, "%s: could not load scene\n", scenes[k].name.c_str() );
+	}
+
+	FILE *f = outName ? fopen( outName, "w" ) : stdout;
+	if( !f ) {
+		fprintf( stderr, "can't write %s\n", outName );
+		return 1;
+	}
+	writeJSON( f, results );
+	if( outName )
+		fclose( f );
+
+	return 0;
+}
@@ -10,6 +10,7 @@
 //
 
 #include "bitmap.h"
+#include "../RenderStats.h"
  
 BMP_BITMAPFILEHEADER bmfh; 
 BMP_BITMAPINFOHEADER bmih; 
@@ -99,6 +100,7 @@ unsigned char *readBMP(char *fname, int& width, int& height)
  
 void writeBMP(char *iname, int width, int height, unsigned char *data) 
 { 
+	STAT_TIMER( WRITE );
 	int bytes, pad;
 	bytes = width * 3;
 	pad = (bytes%4) ? 4-(bytes%4) : 0;
@@ -0,0 +1,325 @@
+#include <ctype.h>
+#include <math.h>
+#include <string.h>
+
+#include <vector>
+
+#include <png.h>
+
+#include "imagewriter.h"
+#include "bitmap.h"
+#include "../RenderStats.h"
+
+ImageWriter::ImageWriter()
+	: file( NULL ), width( 0 ), height( 0 ), compression( 6 ), failed( false ),
+	  row( NULL ), quantized( NULL )
+{
+}
+
+ImageWriter::~ImageWriter()
+{
+	if( file )
+		fclose( file );
+	delete [] row;
+	delete [] quantized;
+}
+
+void ImageWriter::setCompression( int level )
+{
+	compression = level < 0 ? 0 : level > 9 ? 9 : level;
+}
+
+bool ImageWriter::open( const string& filename, int w, int h )
+{
+	file = fopen( filename.c_str(), "wb" );
+	if( !file )
+		return false;
+
+	width = w;
+	height = h;
+	failed = false;
+	row = new unsigned char[ width * 4 + 4 ];
+	quantized = new unsigned char[ width * 3 ];
+
+	writeHeader();
+	return !failed;
+}
+
+bool ImageWriter::close()
+{
+	if( !file )
+		return false;
+
+	writeTrailer();
+	if( fclose( file ) )
+		failed = true;
+	file = NULL;
+	return !failed;
+}
+
+void ImageWriter::put( const void *data, size_t bytes )
+{
+	if( !failed && bytes && fwrite( data, 1, bytes, file ) != bytes )
+		failed = true;
+}
+
+// Clamped and truncated the way RayTracer::setPixel does it.
+void ImageWriter::writeRow( const float *rgb )
+{
+	for( int k = 0; k < width * 3; ++k ) {
+		float v = rgb[k] < 0.0f ? 0.0f : rgb[k] > 1.0f ? 1.0f : rgb[k];
+		quantized[k] = (unsigned char)(int)(255.0f * v);
+	}
+	writeRow( (const unsigned char*)quantized );
+}
+
+void ImageWriter::writeRows( const unsigned char *image, int y0, int y1 )
+{
+	if( topDown() ) {
+		for( int j = y1 - 1; j >= y0; --j )
+			writeRow( image + j * width * 3 );
+	} else {
+		for( int j = y0; j < y1; ++j )
+			writeRow( image + j * width * 3 );
+	}
+}
+
+void ImageWriter::writeRows( const float *image, int y0, int y1 )
+{
+	if( topDown() ) {
+		for( int j = y1 - 1; j >= y0; --j )
+			writeRow( image + j * width * 3 );
+	} else {
+		for( int j = y0; j < y1; ++j )
+			writeRow( image + j * width * 3 );
+	}
+}
+
+// Binary PPM: the pixels go out exactly as they come in.
+class PPMWriter : public ImageWriter
+{
+public:
+	using ImageWriter::writeRow;
+
+	virtual void writeRow( const unsigned char *rgb )
+	{
+		put( rgb, width * 3 );
+	}
+
+protected:
+	virtual void writeHeader()
+	{
+		if( fprintf( file, "P6\n%d %d\n255\n", width, height ) < 0 )
+			failed = true;
+	}
+};
+
+// 24 bit BMP, bottom row first, in BGR order with each row padded to a
+// multiple of 4 bytes.
+class BMPWriter : public ImageWriter
+{
+public:
+	using ImageWriter::writeRow;
+
+	virtual bool topDown() const { return false; }
+
+	virtual void writeRow( const unsigned char *rgb )
+	{
+		int bytes = rowBytes();
+		for( int i = 0; i < width; ++i ) {
+			row[ 3*i ] = rgb[ 3*i + 2 ];
+			row[ 3*i + 1 ] = rgb[ 3*i + 1 ];
+			row[ 3*i + 2 ] = rgb[ 3*i ];
+		}
+		memset( row + width * 3, 0, bytes - width * 3 );
+		put( row, bytes );
+	}
+
+protected:
+	int rowBytes() const { return (width * 3 + 3) & ~3; }
+
+	virtual void writeHeader()
+	{
+		// the file header is 14 bytes on disk; see writeBMP
+		BMP_WORD type = 0x4d42;		// "BM"
+		BMP_DWORD offBits = 14 + sizeof( BMP_BITMAPINFOHEADER );
+		BMP_DWORD size = offBits + rowBytes() * height;
+		BMP_WORD reserved = 0;
+
+		put( &type, 2 );
+		put( &size, 4 );
+		put( &reserved, 2 );
+		put( &reserved, 2 );
+		put( &offBits, 4 );
+
+		BMP_BITMAPINFOHEADER info;
+		info.biSize = sizeof( BMP_BITMAPINFOHEADER );
+		info.biWidth = width;
+		info.biHeight = height;
+		info.biPlanes = 1;
+		info.biBitCount = 24;
+		info.biCompression = BMP_BI_RGB;
+		info.biSizeImage = 0;
+		info.biXPelsPerMeter = (int)(100 / 2.54 * 72);
+		info.biYPelsPerMeter = (int)(100 / 2.54 * 72);
+		info.biClrUsed = 0;
+		info.biClrImportant = 0;
+		put( &info, sizeof( info ) );
+	}
+};
+
+// 8 bit RGB PNG.  libpng reports errors by jumping back to the setjmp
+// of the call that failed; after that the writer only remembers that
+// it failed.
+class PNGWriter : public ImageWriter
+{
+public:
+	using ImageWriter::writeRow;
+
+	PNGWriter()
+		: png( NULL ), info( NULL ) {}
+
+	virtual ~PNGWriter()
+	{
+		if( png )
+			png_destroy_write_struct( &png, &info );
+	}
+
+	virtual void writeRow( const unsigned char *rgb )
+	{
+		if( failed || setjmp( png_jmpbuf( png ) ) ) {
+			failed = true;
+			return;
+		}
+		png_write_row( png, (png_bytep)rgb );
+	}
+
+protected:
+	virtual void writeHeader()
+	{
+		png = png_create_write_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
+		if( png )
+			info = png_create_info_struct( png );
+		if( !png || !info || setjmp( png_jmpbuf( png ) ) ) {
+			failed = true;
+			return;
+		}
+
+		png_init_io( png, file );
+		png_set_compression_level( png, compression );
+		// at the fastest levels the row filters cost more than they save
+		if( compression <= 1 )
+			png_set_filter( png, 0, PNG_FILTER_NONE );
+		png_set_IHDR( png, info, width, height, 8, PNG_COLOR_TYPE_RGB,
+			PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT );
+		png_write_info( png, info );
+	}
+
+	virtual void writeTrailer()
+	{
+		if( failed || setjmp( png_jmpbuf( png ) ) ) {
+			failed = true;
+			return;
+		}
+		png_write_end( png, info );
+	}
+
+private:
+	png_structp png;
+	png_infop info;
+};
+
+// Radiance RGBE: each pixel is three 8 bit mantissas sharing an 8 bit
+// exponent, which keeps colours far outside [0,1].  The scanlines are
+// written flat, without run length encoding.
+class HDRWriter : public ImageWriter
+{
+public:
+	virtual bool floatingPoint() const { return true; }
+
+	virtual void writeRow( const unsigned char *rgb )
+	{
+		pixels.resize( width * 3 );
+		for( int k = 0; k < width * 3; ++k )
+			pixels[k] = rgb[k] / 255.0f;
+		writeRow( &pixels[0] );
+	}
+
+	virtual void writeRow( const float *rgb )
+	{
+		for( int i = 0; i < width; ++i ) {
+			const float *c = rgb + 3 * i;
+			unsigned char *e = row + 4 * i;
+			float r = c[0] > 0.0f ? c[0] : 0.0f;
+			float g = c[1] > 0.0f ? c[1] : 0.0f;
+			float b = c[2] > 0.0f ? c[2] : 0.0f;
+			float v = r > g ? (r > b ? r : b) : (g > b ? g : b);
+
+			if( v < 1.0e-32f ) {
+				e[0] = e[1] = e[2] = e[3] = 0;
+			} else {
+				int exponent;
+				float scale = (float)frexp( v, &exponent ) * 256.0f / v;
+				e[0] = (unsigned char)(r * scale);
+				e[1] = (unsigned char)(g * scale);
+				e[2] = (unsigned char)(b * scale);
+				e[3] = (unsigned char)(exponent + 128);
+			}
+		}
+		put( row, width * 4 );
+	}
+
+protected:
+	virtual void writeHeader()
+	{
+		if( fprintf( file, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %d +X %d\n",
+				height, width ) < 0 )
+			failed = true;
+	}
+
+private:
+	vector<float> pixels;
+};
+
+static string extension( const string& filename )
+{
+	size_t dot = filename.find_last_of( "./\\" );
+	if( dot == string::npos || filename[ dot ] != '.' )
+		return string();
+
+	string ext = filename.substr( dot + 1 );
+	for( int k = 0; k < (int)ext.size(); ++k )
+		ext[k] = (char)tolower( (unsigned char)ext[k] );
+	return ext;
+}
+
+ImageWriter *ImageWriter::create( const string& filename )
+{
+	string ext = extension( filename );
+	if( ext == "ppm" )
+		return new PPMWriter;
+	if( ext == "png" )
+		return new PNGWriter;
+	if( ext == "hdr" )
+		return new HDRWriter;
+	return new BMPWriter;
+}
+
+bool writeImage( const string& filename, int width, int height,
+	const unsigned char *data, int compression, const float *radiance )
+{
+	STAT_TIMER( WRITE );
+	ImageWriter *out = ImageWriter::create( filename );
+	out->setCompression( compression );
+
+	bool ok = out->open( filename, width, height );
+	if( ok ) {
+		if( radiance && out->floatingPoint() )
+			out->writeRows( radiance, 0, height );
+		else
+			out->writeRows( data, 0, height );
+		ok = out->close();
+	}
+	delete out;
+	return ok;
+}
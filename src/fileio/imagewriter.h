@@ -0,0 +1,88 @@
+#ifndef __IMAGEWRITER_H__
+#define __IMAGEWRITER_H__
+
+// Writers for the rendered image, one per file format.  They take the
+// image a row at a time, in the order the file stores its rows, so an
+// image can be written out while the rest of it is still rendering
+// (see RayTracer::traceTiles) and a writer never holds more than a row
+// of its own.
+//
+//   .ppm   binary PPM: a short header and the raw pixels
+//   .png   8 bit RGB PNG, through the libpng and zlib bundled with FLTK
+//   .hdr   Radiance RGBE, for floating point pixels
+//   .bmp   24 bit BMP, as writeBMP writes it; also any other name
+
+#include <stdio.h>
+
+#include <string>
+
+using namespace std;
+
+class ImageWriter
+{
+public:
+	// A writer for filename, chosen by its extension.
+	static ImageWriter *create( const string& filename );
+
+	virtual ~ImageWriter();
+
+	// The zlib compression level for PNG, 0 (none) to 9 (smallest);
+	// the default is 6.  The other formats ignore it.
+	void setCompression( int level );
+
+	// Create the file and write the header for a width x height image.
+	bool open( const string& filename, int width, int height );
+
+	// Does the file store the top row first?  BMP stores the bottom
+	// row first.
+	virtual bool topDown() const { return true; }
+
+	// Does the format hold floating point pixels?  Then it should be
+	// given the radiance rather than the tone mapped image.
+	virtual bool floatingPoint() const { return false; }
+
+	// Write the next row: width RGB pixels, 8 bit or floating point.
+	// Floating point rows are clamped and quantized for the 8 bit
+	// formats; 8 bit rows are scaled to [0,1] for HDR.
+	virtual void writeRow( const unsigned char *rgb ) = 0;
+	virtual void writeRow( const float *rgb );
+
+	// Write rows [y0,y1) of an image that is stored bottom row first,
+	// like RayTracer's buffers, in the order the file wants them.
+	void writeRows( const unsigned char *image, int y0, int y1 );
+	void writeRows( const float *image, int y0, int y1 );
+
+	// Finish the file.  False if anything since open() failed.
+	bool close();
+
+protected:
+	ImageWriter();
+
+	virtual void writeHeader() = 0;
+	virtual void writeTrailer() {}
+
+	void put( const void *data, size_t bytes );
+
+	FILE *file;
+	int width, height;
+	int compression;
+	bool failed;
+
+	// a row's worth of scratch space
+	unsigned char *row;
+
+private:
+	// where writeRow( const float* ) quantizes a row to
+	unsigned char *quantized;
+
+	ImageWriter( const ImageWriter& );
+	ImageWriter& operator =( const ImageWriter& );
+};
+
+// Write a whole 8 bit image, stored bottom row first, to filename in
+// the format its extension asks for.  If the image's radiance is given
+// too, floating point formats are written from that instead.
+bool writeImage( const string& filename, int width, int height,
+	const unsigned char *data, int compression = 6, const float *radiance = NULL );
+
+#endif // __IMAGEWRITER_H__
@@ -0,0 +1,116 @@
+#ifdef WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "mapfile.h"
+
+static const char emptyFile[1] = { 0 };
+
+MappedFile::MappedFile()
+	: data( emptyFile ), length( 0 )
+{
+#ifdef WIN32
+	file = INVALID_HANDLE_VALUE;
+	mapping = NULL;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+#ifdef WIN32
+
+bool MappedFile::open( const string& filename )
+{
+	close();
+
+	file = CreateFileA( filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	if( file == INVALID_HANDLE_VALUE )
+		return false;
+
+	LARGE_INTEGER size;
+	if( !GetFileSizeEx( file, &size ) ) {
+		close();
+		return false;
+	}
+	if( size.QuadPart == 0 )
+		return true;
+
+	mapping = CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL );
+	void *view = mapping ? MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 ) : NULL;
+	if( !view ) {
+		close();
+		return false;
+	}
+
+	data = (const char*)view;
+	length = (size_t)size.QuadPart;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if( length )
+		UnmapViewOfFile( data );
+	if( mapping )
+		CloseHandle( mapping );
+	if( file != INVALID_HANDLE_VALUE )
+		CloseHandle( file );
+
+	data = emptyFile;
+	length = 0;
+	file = INVALID_HANDLE_VALUE;
+	mapping = NULL;
+}
+
+#else
+
+bool MappedFile::open( const string& filename )
+{
+	close();
+
+	int fd = ::open( filename.c_str(), O_RDONLY );
+	if( fd < 0 )
+		return false;
+
+	struct stat st;
+	if( fstat( fd, &st ) || !S_ISREG( st.st_mode ) ) {
+		::close( fd );
+		return false;
+	}
+	if( st.st_size == 0 ) {
+		::close( fd );
+		return true;
+	}
+
+	// the mapping stays valid once the descriptor is closed
+	void *view = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	::close( fd );
+	if( view == MAP_FAILED )
+		return false;
+	madvise( view, st.st_size, MADV_SEQUENTIAL );
+
+	data = (const char*)view;
+	length = (size_t)st.st_size;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if( length )
+		munmap( (void*)data, length );
+
+	data = emptyFile;
+	length = 0;
+}
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef __MAPFILE_H__
+#define __MAPFILE_H__
+
+// A read-only view of a whole file, mapped into memory so that the
+// parser can scan it with plain pointers instead of pulling characters
+// through an istream.
+
+#include <string>
+
+using namespace std;
+
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	// Map the file; false if it can't be opened.  An empty file maps
+	// to an empty range.
+	bool open( const string& filename );
+	void close();
+
+	const char *begin() const { return data; }
+	const char *end() const { return data + length; }
+	size_t size() const { return length; }
+
+private:
+	MappedFile( const MappedFile& );
+	MappedFile& operator =( const MappedFile& );
+
+	const char *data;
+	size_t length;
+#ifdef WIN32
+	void *file;
+	void *mapping;
+#endif
+};
+
+#endif // __MAPFILE_H__
@@ -5,189 +5,386 @@
 #endif
 
 #include <cstring>
+#include <cstdlib>
+#include <algorithm>
 
 #include "parse.h"
 
-static string readID( istream& is );
-static Obj *readString( istream& is );
-static Obj *readScalar( istream& is );
-static Obj *readTuple( istream& is );
-static Obj *readDict( istream& is );
-static Obj *readObject( istream& is );
-static Obj *readName( istream& is );
-static void eatWS( istream& is );
-static void eatNL( istream& is );
-
-Obj *readFile( istream& is )
+// The parser works on a ParseBuffer rather than an istream: skipping
+// whitespace and comments and collecting identifiers and numbers is
+// pointer arithmetic over the buffer, and numbers are converted without
+// copying them out first.  The tree it builds goes into a ParseArena.
+
+static const size_t ARENA_BLOCK = 256 * 1024;
+
+ParseArena::ParseArena()
+	: cur( NULL ), limit( NULL )
+{
+}
+
+ParseArena::~ParseArena()
 {
-	return readObject( is );
+	for( size_t k = 0; k < blocks.size(); ++k )
+		delete [] blocks[k];
 }
 
-static void eatWS( istream& is )
+void *ParseArena::alloc( size_t size )
 {
-	int ch = is.peek();
-	while( ch == ' ' || ch == '\t' || ch == '\n' || ch == 0x0D || ch == 0x0A) {
-		is.get();
-		if( !is ) {
-			return;
+	// everything is kept aligned for doubles and pointers
+	size = (size + 7) & ~size_t( 7 );
+
+	if( size > size_t( limit - cur ) ) {
+		// a big request gets a block of its own, and the current block
+		// stays in use
+		if( size > ARENA_BLOCK / 4 ) {
+			char *big = new char[ size ];
+			blocks.insert( blocks.end() - (blocks.empty() ? 0 : 1), big );
+			return big;
 		}
-		ch = is.peek();
+		cur = new char[ ARENA_BLOCK ];
+		limit = cur + ARENA_BLOCK;
+		blocks.push_back( cur );
 	}
+
+	void *p = cur;
+	cur += size;
+	return p;
 }
 
-static void eatNL( istream& is )
+const char *ParseArena::copy( const char *b, const char *e )
 {
-	int ch = is.peek();
-	while( ch != '\n' ) {
-		is.get();
-		if( !is ) {
-			return;
-		}
-		ch = is.peek();
+	char *s = (char*)alloc( e - b + 1 );
+	memcpy( s, b, e - b );
+	s[ e - b ] = '\0';
+	return s;
+}
+
+const char *ParseArena::intern( const char *b, const char *e )
+{
+	string key( b, e );
+	map<string, const char*>::iterator i = symbols.find( key );
+	if( i != symbols.end() )
+		return i->second;
+
+	const char *s = copy( b, e );
+	symbols[ key ] = s;
+	return s;
+}
+
+void ParseArena::clear()
+{
+	symbols.clear();
+	if( blocks.empty() )
+		return;
+
+	// keep a block of the usual size, if there is one
+	size_t keep = blocks.size();
+	if( limit && limit - ARENA_BLOCK == blocks.back() )
+		keep = blocks.size() - 1;
+	for( size_t k = 0; k < blocks.size(); ++k ) {
+		if( k != keep )
+			delete [] blocks[k];
+	}
+
+	if( keep < blocks.size() ) {
+		char *block = blocks[ keep ];
+		blocks.assign( 1, block );
+		cur = block;
+		limit = block + ARENA_BLOCK;
+	} else {
+		blocks.clear();
+		cur = limit = NULL;
 	}
 }
 
-static bool eat( istream& is ) 
+// The state of one readFile call.  Tuples and dictionaries collect their
+// elements on these stacks while they are read, since their sizes are
+// only known at the closing bracket; nested ones push above and pop
+// before their parent goes on.  Then they are copied into the arena.
+struct Parser
+{
+	Parser( ParseBuffer& i, ParseArena& a )
+		: in( i ), arena( a ) {}
+
+	ParseBuffer& in;
+	ParseArena& arena;
+	vector<Obj*> items;
+	vector<double> numbers;
+	vector<DictEntry> entries;
+};
+
+static const char *readID( Parser& p );
+static Obj *readString( Parser& p );
+static Obj *readScalar( Parser& p );
+static Obj *readTuple( Parser& p );
+static Obj *readDict( Parser& p );
+static Obj *readObject( Parser& p );
+static Obj *readName( Parser& p );
+static void eatWS( ParseBuffer& in );
+static void eatNL( ParseBuffer& in );
+
+Obj *readFile( ParseBuffer& in, ParseArena& arena )
+{
+	Parser p( in, arena );
+	return readObject( p );
+}
+
+static void eatWS( ParseBuffer& in )
 {
-	while( is ) {
-		eatWS( is );
-		if( is ) {
-			int ch = is.peek();
+	const char *p = in.cur;
+	while( p < in.end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == 0x0D || *p == 0x0A) )
+		++p;
+	in.cur = p;
+}
+
+// skip to the end of the line, leaving the newline
+static void eatNL( ParseBuffer& in )
+{
+	const char *nl = (const char*)memchr( in.cur, '\n', in.end - in.cur );
+	in.cur = nl ? nl : in.end;
+}
+
+// Skip whitespace and comments; false at the end of the input.
+static bool eat( ParseBuffer& in )
+{
+	while( true ) {
+		eatWS( in );
+		int ch = in.peek();
+		if( ch == '/' ) {
+			in.get();
+			ch = in.peek();
 			if( ch == '/' ) {
-				is.get();
-				int ch = is.peek();
-				if( ch == '/' ) {
-					eatNL( is );
-				} else if( ch == '*' ) {
-					while( true ) {
-						is.get();
-						ch = is.peek();
-						if( ch == '*' ) {
-							is.get();
-							ch = is.peek();
-							if( ch == '/' ) {
-								is.get();
-								break;
-							} else if( ch == -1 ) {	
-								is.get();
-								throw ParseError( 
-									"Parse Error: unterminated comment" );
-							}
-						} else if( ch == -1 ) {
-							is.get();
-							throw ParseError( 
-								"Parse Error: unterminated comment" );
-						}
+				eatNL( in );
+			} else if( ch == '*' ) {
+				const char *p = in.cur + 1;
+				while( true ) {
+					p = (const char*)memchr( p, '*', in.end - p );
+					if( !p || p + 1 >= in.end ) {
+						in.cur = in.end;
+						throw ParseError(
+							"Parse Error: unterminated comment" );
 					}
-				} else {
-					return true;
+					if( p[1] == '/' )
+						break;
+					++p;
 				}
-			} else if( ch == -1 ) {
-				is.get();
-				return false;
+				in.cur = p + 2;
 			} else {
 				return true;
 			}
-		} else {
+		} else if( ch == -1 ) {
 			return false;
+		} else {
+			return true;
 		}
 	}
-	return false;
 }
 
-static Obj *readName( istream& is )
+static Obj *readName( Parser& p )
 {
-	string s = readID( is );
+	const char *s = readID( p );
 
-	if( s == "true" ) {
-		return new BooleanObj( true );
-	} else if( s == "false" ) {
-		return new BooleanObj( false );
+	if( !strcmp( s, "true" ) ) {
+		return p.arena.create<BooleanObj>( true );
+	} else if( !strcmp( s, "false" ) ) {
+		return p.arena.create<BooleanObj>( false );
 	} else {
-		if( !eat( is ) ) {
-			return new IdObj( s );
+		if( !eat( p.in ) ) {
+			return p.arena.create<IdObj>( s );
 		}
 
-		int ch = is.peek();
+		int ch = p.in.peek();
 		if( strchr( "}),;", ch ) != NULL ) {
-			return new IdObj( s );
+			return p.arena.create<IdObj>( s );
 		} else {
-			return new NamedObj( s, readObject( is ) );
+			Obj *child = readObject( p );
+			return p.arena.create<NamedObj>( s, child );
 		}
 	}
 }
 
-static string readID( istream& is )
+static inline bool endsID( char ch )
 {
-	int ch;
-	string ret( "" );
+	switch( ch ) {
+	case ' ': case '\t': case '\n': case '=': case '{': case '}':
+	case '(': case ')': case ';': case ',': case '/': case '\0':
+		return true;
+	default:
+		return false;
+	}
+}
 
-	ret += char( is.get() );
+// An identifier runs up to the next delimiter; its first character is
+// taken whatever it is.
+static const char *readID( Parser& p )
+{
+	ParseBuffer& in = p.in;
+	const char *start = in.cur;
+	const char *c = in.cur;
 
-	while( is ) {
-		ch = is.peek();
-		if( strchr( " \t\n={}();,/", ch ) != NULL ) {
-			break;
-		} else {
-			ret += char( ch );
-			is.get();
-		}
+	if( c < in.end )
+		++c;
+	while( c < in.end && !endsID( *c ) )
+		++c;
+
+	in.cur = c;
+	return p.arena.intern( start, c );
+}
+
+static Obj *readString( Parser& p )
+{
+	ParseBuffer& in = p.in;
+	in.get();
+
+	const char *quote = (const char*)memchr( in.cur, '"', in.end - in.cur );
+	if( !quote ) {
+		in.cur = in.end;
+		throw ParseError( "Parse error: unterminated string." );
 	}
 
-	return ret;
+	const char *s = p.arena.copy( in.cur, quote );
+	size_t n = quote - in.cur;
+	in.cur = quote + 1;
+	return p.arena.create<StringObj>( s, n );
 }
 
-static Obj *readString( istream& is ) 
+static const double powersOf10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Numbers with at most 15 significant digits and a small exponent, which
+// is nearly all of them, are exact in a double, as is the power of ten,
+// so one multiplication or division rounds them correctly.  The rest go
+// through atof.
+double parseScalar( const char *s, const char *e )
 {
-	int ch;
-	string ret( "" );
+	const char *p = s;
+	bool negative = false;
+	if( p < e && *p == '-' ) {
+		negative = true;
+		++p;
+	}
 
-	is.get();
+	unsigned long long mantissa = 0;
+	int significant = 0;
+	int exponent = 0;
+	bool digits = false;
 
-	while( true ) {
-		ch = is.peek();
-		if( ch == '"' ) {
-			is.get();
-			return new StringObj( ret );
-		} else {
-			ret += char( ch );
+	for( ; p < e && *p >= '0' && *p <= '9'; ++p ) {
+		digits = true;
+		if( mantissa || *p != '0' ) {
+			mantissa = mantissa * 10 + (*p - '0');
+			++significant;
 		}
-		is.get();
+		if( significant > 15 )
+			break;
 	}
+	if( significant <= 15 && p < e && *p == '.' ) {
+		for( ++p; p < e && *p >= '0' && *p <= '9'; ++p ) {
+			digits = true;
+			if( mantissa || *p != '0' ) {
+				mantissa = mantissa * 10 + (*p - '0');
+				++significant;
+			}
+			--exponent;
+			if( significant > 15 )
+				break;
+		}
+	}
+
+	if( digits && significant <= 15 ) {
+		if( p < e && (*p == 'e' || *p == 'E') ) {
+			const char *q = p + 1;
+			bool negExp = false;
+			if( q < e && *q == '-' ) {
+				negExp = true;
+				++q;
+			}
+			if( q < e && *q >= '0' && *q <= '9' ) {
+				int value = 0;
+				for( ; q < e && *q >= '0' && *q <= '9'; ++q ) {
+					if( value < 10000 )
+						value = value * 10 + (*q - '0');
+				}
+				exponent += negExp ? -value : value;
+			}
+		}
+
+		double d = double( mantissa );
+		if( mantissa == 0 || exponent == 0 )
+			return negative ? -d : d;
+		if( exponent > 0 && exponent <= 22 ) {
+			d *= powersOf10[ exponent ];
+			return negative ? -d : d;
+		}
+		if( exponent < 0 && exponent >= -22 ) {
+			d /= powersOf10[ -exponent ];
+			return negative ? -d : d;
+		}
+	}
+
+	return atof( string( s, e ).c_str() );
 }
 
-static Obj *readScalar( istream& is )
+static inline bool startsScalar( int ch )
 {
-	int ch;
-	string ret( "" );
+	return (ch == '-') || (ch >= '0' && ch <= '9');
+}
 
-	while( true ) {
-		ch = is.peek();
+static double readNumber( ParseBuffer& in )
+{
+	const char *start = in.cur;
+	const char *c = in.cur;
+
+	while( c < in.end ) {
+		char ch = *c;
 		if( (ch == '-') || (ch == '.') || (ch == 'e') || (ch == 'E')
 				|| (ch >= '0' && ch <= '9') ) {
-			ret += char( ch );
-			is.get();
+			++c;
 		} else {
 			break;
 		}
 	}
 
-	return new ScalarObj( atof( ret.c_str() ) );
+	in.cur = c;
+	return parseScalar( start, c );
+}
+
+static Obj *readScalar( Parser& p )
+{
+	return p.arena.create<ScalarObj>( readNumber( p.in ) );
 }
 
-static Obj *readTuple( istream& is )
+// While a tuple holds nothing but numbers they are kept as plain
+// doubles, and the tuple becomes one array of ScalarObjs.  Anything else
+// turns the numbers read so far into nodes of their own.
+static Obj *readTuple( Parser& p )
 {
-	vector<Obj*> ret;
+	size_t itemBase = p.items.size();
+	size_t numberBase = p.numbers.size();
+	bool numeric = true;
 
-	is.get();
+	p.in.get();
 
 	while( true ) {
-		eat( is );
-		ret.push_back( readObject( is ) );	
-		eat( is );
-		int ch = is.get();
+		eat( p.in );
+		if( numeric && startsScalar( p.in.peek() ) ) {
+			p.numbers.push_back( readNumber( p.in ) );
+		} else {
+			if( numeric ) {
+				for( size_t k = numberBase; k < p.numbers.size(); ++k )
+					p.items.push_back( p.arena.create<ScalarObj>( p.numbers[k] ) );
+				p.numbers.resize( numberBase );
+				numeric = false;
+			}
+			Obj *item = readObject( p );
+			p.items.push_back( item );
+		}
+		eat( p.in );
+		int ch = p.in.get();
 		if( ch == ')' ) {
-			return new TupleObj( ret );
+			break;
 		} else if( ch == ',' ) {
 			continue;
 		} else {
@@ -195,68 +392,97 @@ static Obj *readTuple( istream& is )
 		}
 	}
 
-	throw ParseError( "Parse error: internal error." );
+	if( numeric ) {
+		size_t n = p.numbers.size() - numberBase;
+		ScalarObj *scalars = p.arena.allocArray<ScalarObj>( n );
+		for( size_t k = 0; k < n; ++k )
+			new( scalars + k ) ScalarObj( p.numbers[ numberBase + k ] );
+		p.numbers.resize( numberBase );
+		return p.arena.create<TupleObj>( mytuple( scalars, n ) );
+	}
+
+	size_t n = p.items.size() - itemBase;
+	Obj **items = p.arena.allocArray<Obj*>( n );
+	copy( p.items.begin() + itemBase, p.items.end(), items );
+	p.items.resize( itemBase );
+	return p.arena.create<TupleObj>( mytuple( items, n ) );
 }
 
-static Obj *readDict( istream& is )
+static Obj *readDict( Parser& p )
 {
-	string lhs;
-	Obj *rhs;
+	size_t base = p.entries.size();
 
-	map<string,Obj*> ret;
-
-	is.get();
+	p.in.get();
 
 	while( true ) {
-		eat( is );
-		if( is.peek() == '}' ) {
-			is.get();
-			return new DictObj( ret );
+		eat( p.in );
+		if( p.in.peek() == '}' ) {
+			p.in.get();
+			break;
 		}
-		lhs = readID( is );
-		eat( is );
-		if( is.get() != '=' ) {
+		const char *lhs = readID( p );
+		eat( p.in );
+		if( p.in.get() != '=' ) {
 			throw ParseError( "Parse error: expected equals." );
 		}
-		rhs = readObject( is );
-		ret[ lhs ] = rhs;
-		eat( is );
-		int ch = is.peek();
+		Obj *rhs = readObject( p );
+
+		// keys are interned, so comparing pointers is enough
+		size_t k = base;
+		while( k < p.entries.size() && p.entries[k].first != lhs )
+			++k;
+		if( k < p.entries.size() ) {
+			p.entries[k].second = rhs;
+		} else {
+			DictEntry e = { lhs, rhs };
+			p.entries.push_back( e );
+		}
+
+		eat( p.in );
+		int ch = p.in.peek();
 		if( ch == ';' ) {
-			is.get();
+			p.in.get();
 		} else if( ch != '}' ) {
 			throw ParseError( "Parse error: expected semicolon or brace." );
 		}
 	}
+
+	size_t n = p.entries.size() - base;
+	DictEntry *entries = p.arena.allocArray<DictEntry>( n );
+	copy( p.entries.begin() + base, p.entries.end(), entries );
+	p.entries.resize( base );
+	return p.arena.create<DictObj>( dict( entries, n ) );
 }
 
-static Obj *readObject( istream& is )
+static Obj *readObject( Parser& p )
 {
-	if( !eat( is ) ) {
+	if( !eat( p.in ) ) {
 		return NULL;
 	}
 
-	int ch = is.peek();
+	int ch = p.in.peek();
 
-	if( (ch == '-') || (ch >= '0' && ch <= '9') ) {
-		return readScalar( is );
+	if( startsScalar( ch ) ) {
+		return readScalar( p );
 	} else if( ch == '"' ) {
-		return readString( is );
+		return readString( p );
 	} else if( ch == '(' ) {
-		return readTuple( is );
+		return readTuple( p );
 	} else if( ch == '{' ) {
-		return readDict( is );
+		return readDict( p );
 	} else {
-		return readName( is );
+		return readName( p );
 	}
 }
 
 /*
 int main( void )
 {
-	Obj *o = readFile( cin );
+	string text( (istreambuf_iterator<char>( cin )), istreambuf_iterator<char>() );
+	ParseBuffer in( text.data(), text.data() + text.size() );
+	ParseArena arena;
+	Obj *o = readFile( in, arena );
 	o->printOn( cout );
-	delete o;
 	return 0;
 }
 */
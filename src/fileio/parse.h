@@ -4,6 +4,9 @@
 // classes are truncated.  Not my problem, eh?
 #pragma warning( disable : 4786 )
 
+#include <string.h>
+#include <new>
+#include <utility>
 #include <string>
 #include <vector>
 #include <map>
@@ -29,9 +32,118 @@ inline ostream& operator <<( ostream& os, const Exception& x )
 }
 
 class Obj;
+class ScalarObj;
 
-typedef vector<Obj*> 		mytuple;
-typedef map<string,Obj*> 	dict;
+// The parse tree lives in a ParseArena: every node, array and string of
+// it is bump-allocated from a few large blocks, and all of it is
+// released at once when the arena is cleared or destroyed.  Nodes are
+// never deleted one by one, so they hold no resources of their own.
+class ParseArena
+{
+public:
+	ParseArena();
+	~ParseArena();
+
+	void *alloc( size_t size );
+	template <class T> T *allocArray( size_t n )
+	{ return (T*)alloc( n * sizeof( T ) ); }
+
+	// a node constructed in the arena
+	template <class T, class... Args> T *create( Args&&... args )
+	{ return new( alloc( sizeof( T ) ) ) T( std::forward<Args>( args )... ); }
+
+	// A NUL-terminated copy of [b,e).  intern() returns the same copy
+	// for the same text, so identifiers and dictionary keys are stored
+	// once however often they appear.
+	const char *copy( const char *b, const char *e );
+	const char *intern( const char *b, const char *e );
+
+	// release everything allocated so far; the first block is kept
+	void clear();
+
+private:
+	ParseArena( const ParseArena& );
+	ParseArena& operator =( const ParseArena& );
+
+	vector<char*> blocks;
+	char *cur;
+	char *limit;
+	map<string, const char*> symbols;
+};
+
+// The elements of a tuple.  Tuples of plain numbers keep them in one
+// array of ScalarObjs; other tuples point to their elements.
+class mytuple
+{
+public:
+	mytuple() : items( NULL ), scalars( NULL ), count( 0 ) {}
+	mytuple( Obj **i, size_t n ) : items( i ), scalars( NULL ), count( n ) {}
+	mytuple( ScalarObj *s, size_t n ) : items( NULL ), scalars( s ), count( n ) {}
+
+	size_t size() const { return count; }
+	inline Obj *operator []( size_t k ) const;
+
+	class const_iterator
+	{
+	public:
+		const_iterator() : tuple( NULL ), k( 0 ) {}
+		const_iterator( const mytuple *t, size_t i ) : tuple( t ), k( i ) {}
+
+		Obj *operator *() const { return (*tuple)[ k ]; }
+		const_iterator& operator ++() { ++k; return *this; }
+		const_iterator operator ++( int ) { const_iterator i = *this; ++k; return i; }
+		bool operator ==( const const_iterator& i ) const { return k == i.k; }
+		bool operator !=( const const_iterator& i ) const { return k != i.k; }
+
+	private:
+		const mytuple *tuple;
+		size_t k;
+	};
+
+	const_iterator begin() const { return const_iterator( this, 0 ); }
+	const_iterator end() const { return const_iterator( this, count ); }
+
+private:
+	Obj **items;
+	ScalarObj *scalars;
+	size_t count;
+};
+
+// The fields of a dictionary, in the order they were given, with
+// interned keys.  A key given twice keeps the last value.
+struct DictEntry
+{
+	const char *first;
+	Obj *second;
+};
+
+class dict
+{
+public:
+	typedef const DictEntry *const_iterator;
+
+	dict() : entries( NULL ), count( 0 ) {}
+	dict( DictEntry *e, size_t n ) : entries( e ), count( n ) {}
+
+	size_t size() const { return count; }
+	const_iterator begin() const { return entries; }
+	const_iterator end() const { return entries + count; }
+
+	// dictionaries are small, so a scan beats anything cleverer
+	const_iterator find( const char *key ) const
+	{
+		for( size_t k = 0; k < count; ++k ) {
+			if( !strcmp( entries[k].first, key ) )
+				return entries + k;
+		}
+		return end();
+	}
+	const_iterator find( const string& key ) const { return find( key.c_str() ); }
+
+private:
+	DictEntry *entries;
+	size_t count;
+};
 
 class ParseError
 	: public Exception
@@ -91,7 +203,6 @@ public:
 		: Obj()
 		, val( v )
 	{}
-	virtual ~ScalarObj() {}
 
 	virtual string getTypeName() const { return string( "scalar" ); }
 	virtual void printOn( ostream& os ) const { os << val; }
@@ -102,6 +213,11 @@ private:
 	double val;
 };
 
+inline Obj *mytuple::operator []( size_t k ) const
+{
+	return items ? items[k] : scalars + k;
+}
+
 class BooleanObj
 	: public Obj
 {
@@ -110,7 +226,6 @@ public:
 		: Obj()
 		, val( b )
 	{}
-	virtual ~BooleanObj() {}
 
 	virtual string getTypeName() const { return string( "bool" ); }
 	virtual void printOn( ostream& os ) const { os << (val?"true":"false"); }
@@ -121,63 +236,58 @@ private:
 	bool val;
 };
 
+// the text of an identifier is interned in the arena
 class IdObj
 	: public Obj
 {
 public:
-	IdObj( const string& s )
+	IdObj( const char *s )
 		: Obj()
 		, val( s )
 	{}
-	virtual ~IdObj() {}
 
 	virtual string getTypeName() const { return string( "id" ); }
 	virtual void printOn( ostream& os ) const { os << val; }
-	virtual string getID() const { return val; }
+	virtual string getID() const { return string( val ); }
 
 private:
-	string val;
+	const char *val;
 };
 
 class StringObj
 	: public Obj
 {
 public:
-	StringObj( const string& s )
+	StringObj( const char *s, size_t n )
 		: Obj()
 		, val( s )
+		, len( n )
 	{}
-	virtual ~StringObj() {}
 
 	virtual string getTypeName() const { return string( "string" ); }
-	virtual void printOn( ostream& os ) const { os << '"' << val << '"'; }
-	virtual string getString() const { return val; }
+	virtual void printOn( ostream& os ) const { os << '"' << getString() << '"'; }
+	virtual string getString() const { return string( val, len ); }
 
 private:
-	string val;
+	const char *val;
+	size_t len;
 };
 
 class TupleObj
 	: public Obj
 {
 public:
-	TupleObj( const mytuple& vec )
+	TupleObj( const mytuple& t )
 		: Obj()
-		, val( vec )
+		, val( t )
 	{}
-	virtual ~TupleObj()
-	{
-		for( mytuple::iterator i = val.begin(); i != val.end(); ++i ) {
-			delete (*i);
-		}
-	}
 
 	virtual string getTypeName() const { return string( "tuple" ); }
 	virtual void printOn( ostream& os ) const 
 	{ 
 		bool first = true;
 		os << '(';
-		for( int idx = 0; idx < val.size(); ++idx ) {
+		for( size_t idx = 0; idx < val.size(); ++idx ) {
 			if( first ) {
 				first = false;
 			} else {
@@ -198,24 +308,23 @@ class DictObj
 	: public Obj
 {
 public:
-	DictObj( const dict& m )
+	DictObj( const dict& d )
 		: Obj()
-		, val( m )
+		, val( d )
 	{}
-	virtual ~DictObj()
-	{
-		for( dict::iterator i = val.begin(); i != val.end(); ++i ) {
-			delete ((*i).second);
-		}
-	}
 
 	virtual string getTypeName() const { return string( "dict" ); }
 	virtual void printOn( ostream& os ) const 
 	{ 
+		// in key order, as the fields used to be kept
+		map<string, Obj*> sorted;
+		for( dict::const_iterator ci = val.begin(); ci != val.end(); ++ci )
+			sorted[ ci->first ] = ci->second;
+
 		bool first = true;
 		os << '{';
-		for( dict::const_iterator ci = val.begin(); 
-				ci != val.end(); ++ci ) {
+		for( map<string, Obj*>::const_iterator ci = sorted.begin(); 
+				ci != sorted.end(); ++ci ) {
 			if( first ) {
 				first = false;
 			} else {
@@ -236,15 +345,11 @@ class NamedObj
 	: public Obj
 {
 public:
-	NamedObj( const string& n, Obj *ch )
+	NamedObj( const char *n, Obj *ch )
 		: Obj()
 		, name( n )
 		, child( ch )
 	{}
-	virtual ~NamedObj()
-	{
-		delete child;
-	}
 
 	virtual string getTypeName() const { return string( "named" ); }
 	virtual void printOn( ostream& os ) const 
@@ -253,14 +358,34 @@ public:
 		child->printOn( os );
 	}
 
-	virtual string getName() const { return name; }
+	virtual string getName() const { return string( name ); }
 	virtual Obj *getChild() const { return child; }
 
 private:
-	string name;
+	const char *name;
 	Obj *child;
 };
 
-Obj *readFile( istream& is );
+// The text of a scene description, held in memory (usually a mapped
+// file) and scanned with plain pointers.  Past the end peek() and get()
+// return -1, as an istream's do.
+struct ParseBuffer
+{
+	ParseBuffer( const char *b, const char *e )
+		: cur( b ), end( e ) {}
+
+	int peek() const { return cur < end ? (unsigned char)*cur : -1; }
+	int get() { return cur < end ? (unsigned char)*cur++ : -1; }
+
+	const char *cur;
+	const char *end;
+};
+
+// The next top level object, allocated in arena, or NULL at the end of
+// the input.
+Obj *readFile( ParseBuffer& in, ParseArena& arena );
+
+// Parse a number the way atof would parse the text [s,e).
+double parseScalar( const char *s, const char *e );
 
 #endif // __PARSE_H__
@@ -2,15 +2,17 @@
 #pragma warning( disable : 4786 )
 #endif
 
+#include <cctype>
 #include <cmath>
 #include <cstring>
-#include <fstream>
+#include <iterator>
 #include <strstream>
 
 #include <vector>
 
 #include "read.h"
 #include "parse.h"
+#include "mapfile.h"
 
 #include "../scene/scene.h"
 #include "../SceneObjects/trimesh.h"
@@ -20,33 +22,41 @@
 #include "../SceneObjects/Sphere.h"
 #include "../SceneObjects/Square.h"
 #include "../scene/light.h"
+#include "../RenderStats.h"
 
 typedef map<string,Material*> mmap;
+typedef map<string,Trimesh*> tmap;
 
-static void processObject( Obj *obj, Scene *scene, mmap& materials );
+static void processObject( Obj *obj, Scene *scene, mmap& materials, tmap& meshes );
 static Obj *getColorField( Obj *obj );
 static Obj *getField( Obj *obj, const string& name );
 static bool hasField( Obj *obj, const string& name );
 static vec3f tupleToVec( Obj *obj );
+static string getName( Obj *obj );
 static void processGeometry( string name, Obj *child, Scene *scene,
-	const mmap& materials, TransformNode *transform );
+	const mmap& materials, tmap& meshes, TransformNode *transform );
 static void processTrimesh( string name, Obj *child, Scene *scene,
-                                     const mmap& materials, TransformNode *transform );
+                                     const mmap& materials, tmap& meshes, TransformNode *transform );
+static void processInstance( Obj *child, Scene *scene,
+	const mmap& materials, const tmap& meshes, TransformNode *transform );
 static void processCamera( Obj *child, Scene *scene );
 static Material *getMaterial( Obj *child, const mmap& bindings );
 static Material *processMaterial( Obj *child, mmap *bindings = NULL );
 static void verifyTuple( const mytuple& tup, size_t size );
+static Scene *readScene( ParseBuffer& in );
 
+// The file is mapped rather than read, and parsed in place.
 Scene *readScene( const string& filename )
 {
-	ifstream ifs( filename.c_str() );
-	if( !ifs ) {
+	MappedFile file;
+	if( !file.open( filename ) ) {
 		cerr << "Error: couldn't read scene file " << filename << endl;
 		return NULL;
 	}
 
 	try {
-		return readScene( ifs );
+		ParseBuffer in( file.begin(), file.end() );
+		return readScene( in );
 	} catch( ParseError& pe ) {
 		cout << "Parse error: " << pe << endl;
 		return NULL;
@@ -55,6 +65,14 @@ Scene *readScene( const string& filename )
 
 Scene *readScene( istream& is )
 {
+	string text( (istreambuf_iterator<char>( is )), istreambuf_iterator<char>() );
+	ParseBuffer in( text.data(), text.data() + text.size() );
+	return readScene( in );
+}
+
+static Scene *readScene( ParseBuffer& in )
+{
+	STAT_TIMER( PARSE );
 	Scene *ret = new Scene;
 	
 	// Extract the file header
@@ -62,9 +80,8 @@ Scene *readScene( istream& is )
 	char buf[ MAXNAME ];
 	int ct = 0;
 
-	while( ct < MAXNAME - 1 ) {
-		char c;
-		is.get( c );
+	while( ct < MAXNAME - 1 && in.cur < in.end ) {
+		char c = *in.cur++;
 		if( c == ' ' || c == '\t' || c == '\n' ) {
 			break;
 		}
@@ -77,8 +94,13 @@ Scene *readScene( istream& is )
 		throw ParseError( string( "Input is not an SBT input file." ) );
 	}
 
-	float version;
-	is >> version;
+	// the version number, as operator >> would read it
+	while( in.cur < in.end && isspace( (unsigned char)*in.cur ) )
+		++in.cur;
+	const char *number = in.cur;
+	while( in.cur < in.end && strchr( "+-.eE0123456789", *in.cur ) && *in.cur )
+		++in.cur;
+	float version = (float)parseScalar( number, in.cur );
 
 	if( version != 1.0 ) {
 		ostrstream oss;
@@ -89,15 +111,20 @@ Scene *readScene( istream& is )
 
 	// vector<Obj*> result;
 	mmap materials;
+	tmap meshes;
+
+	// each top level object's tree is dropped in one go once it has
+	// been turned into scene objects
+	ParseArena arena;
 
 	while( true ) {
-		Obj *cur = readFile( is );
+		Obj *cur = readFile( in, arena );
 		if( !cur ) {
 			break;
 		}
 
-		processObject( cur, ret, materials );
-		delete cur;
+		processObject( cur, ret, materials, meshes );
+		arena.clear();
 	}
 
 	return ret;
@@ -154,6 +181,14 @@ static bool hasField( Obj *obj, const string& name )
 	return d.find( name ) != d.end();
 }
 
+// A name given either as an identifier or as a string.
+static string getName( Obj *obj )
+{
+	if( obj->getTypeName() == "id" )
+		return obj->getID();
+	return obj->getString();
+}
+
 // Turn a parsed tuple into a 3D point.
 static vec3f tupleToVec( Obj *obj )
 {
@@ -163,7 +198,7 @@ static vec3f tupleToVec( Obj *obj )
 }
 
 static void processGeometry( Obj *obj, Scene *scene,
-	const mmap& materials, TransformNode *transform )
+	const mmap& materials, tmap& meshes, TransformNode *transform )
 {
 	string name;
 	Obj *child; 
@@ -182,7 +217,7 @@ static void processGeometry( Obj *obj, Scene *scene,
 		throw ParseError( string( oss.str() ) );
 	}
 
-	processGeometry( name, child, scene, materials, transform );
+	processGeometry( name, child, scene, materials, meshes, transform );
 }
 
 // Extract the named scalar field into ret, if it exists.
@@ -221,7 +256,7 @@ static void verifyTuple( const mytuple& tup, size_t size )
 }
 
 static void processGeometry( string name, Obj *child, Scene *scene,
-	const mmap& materials, TransformNode *transform )
+	const mmap& materials, tmap& meshes, TransformNode *transform )
 {
 	if( name == "translate" ) {
 		const mytuple& tup = child->getTuple();
@@ -229,6 +264,7 @@ static void processGeometry( string name, Obj *child, Scene *scene,
         processGeometry( tup[3],
                          scene,
                          materials,
+                         meshes,
                          transform->createChild(mat4f::translate( vec3f(tup[0]->getScalar(), 
                                                                         tup[1]->getScalar(), 
                                                                         tup[2]->getScalar() ) ) ) );
@@ -238,6 +274,7 @@ static void processGeometry( string name, Obj *child, Scene *scene,
 		processGeometry( tup[4],
                          scene,
                          materials,
+                         meshes,
                          transform->createChild(mat4f::rotate( vec3f(tup[0]->getScalar(),
                                                                      tup[1]->getScalar(),
                                                                      tup[2]->getScalar() ),
@@ -249,12 +286,14 @@ static void processGeometry( string name, Obj *child, Scene *scene,
 			processGeometry( tup[1],
                              scene,
                              materials,
+                             meshes,
                              transform->createChild(mat4f::scale( vec3f( sc, sc, sc ) ) ) );
 		} else {
 			verifyTuple( tup, 4 );
 			processGeometry( tup[3],
                              scene,
                              materials,
+                             meshes,
                              transform->createChild(mat4f::scale( vec3f(tup[0]->getScalar(),
                                                                         tup[1]->getScalar(),
                                                                         tup[2]->getScalar() ) ) ) );
@@ -275,6 +314,7 @@ static void processGeometry( string name, Obj *child, Scene *scene,
 		processGeometry( tup[4],
 			             scene,
                          materials,
+                         meshes,
                          transform->createChild(mat4f(vec4f( l1[0]->getScalar(),
                                                              l1[1]->getScalar(),
                                                              l1[2]->getScalar(),
@@ -292,7 +332,9 @@ static void processGeometry( string name, Obj *child, Scene *scene,
                                                              l4[2]->getScalar(),
                                                              l4[3]->getScalar() ) ) ) );
 	} else if( name == "trimesh" || name == "polymesh" ) { // 'polymesh' is for backwards compatibility
-        processTrimesh( name, child, scene, materials, transform);
+        processTrimesh( name, child, scene, materials, meshes, transform);
+	} else if( name == "instance" ) {
+		processInstance( child, scene, materials, meshes, transform );
     } else {
 		SceneObject *obj = NULL;
        	Material *mat;
@@ -330,7 +372,7 @@ static void processGeometry( string name, Obj *child, Scene *scene,
 }
 
 static void processTrimesh( string name, Obj *child, Scene *scene,
-                                     const mmap& materials, TransformNode *transform )
+                                     const mmap& materials, tmap& meshes, TransformNode *transform )
 {
     Material *mat;
     
@@ -389,7 +431,41 @@ static void processTrimesh( string name, Obj *child, Scene *scene,
     if( error = tmesh->doubleCheck() )
         throw ParseError( error );
 
+    tmesh->build();
     scene->add(tmesh);
+
+    // a named mesh can be placed again with instance
+    if( hasField( child, "name" ) )
+        meshes[ getName( getField( child, "name" ) ) ] = tmesh;
+}
+
+// Place another copy of a named trimesh.  The copy shares the mesh's
+// faces and face hierarchy and only adds its own transform and
+// material; without a material it takes the mesh's.  A mesh with
+// per-vertex materials is drawn in those, in every copy, so giving
+// one of its copies a material is an error.
+static void processInstance( Obj *child, Scene *scene,
+	const mmap& materials, const tmap& meshes, TransformNode *transform )
+{
+	if( child == NULL || !hasField( child, "mesh" ) )
+		throw ParseError( "No mesh for instance" );
+
+	string name = getName( getField( child, "mesh" ) );
+	tmap::const_iterator m = meshes.find( name );
+	if( m == meshes.end() )
+		throw ParseError( string( "Unknown mesh: " ) + name );
+
+	Material *mat;
+	if( hasField( child, "material" ) ) {
+		if( m->second->hasVertexMaterials() )
+			throw ParseError( string( "Mesh " ) + name +
+				" has per-vertex materials; its instances can't have a material" );
+		mat = getMaterial( getField( child, "material" ), materials );
+	} else {
+		mat = new Material( m->second->getMaterial() );
+	}
+
+	scene->add( new Trimesh( scene, mat, transform, *m->second ) );
 }
 
 static Material *getMaterial( Obj *child, const mmap& bindings )
@@ -496,7 +572,7 @@ processCamera( Obj *child, Scene *scene )
     }
 }
 
-static void processObject( Obj *obj, Scene *scene, mmap& materials )
+static void processObject( Obj *obj, Scene *scene, mmap& materials, tmap& meshes )
 {
 	// Assume the object is named.
 	string name;
@@ -542,8 +618,9 @@ static void processObject( Obj *obj, Scene *scene, mmap& materials )
 				name == "scale" ||
 				name == "transform" ||
                 name == "trimesh" ||
-                name == "polymesh") { // polymesh is for backwards compatibility.
-		processGeometry( name, child, scene, materials, &scene->transformRoot);
+                name == "polymesh" || // polymesh is for backwards compatibility.
+				name == "instance" ) {
+		processGeometry( name, child, scene, materials, meshes, &scene->transformRoot);
 		//scene->add( geo );
 	} else if( name == "material" ) {
 		processMaterial( child, &materials );
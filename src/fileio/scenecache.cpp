@@ -0,0 +1,661 @@
+#ifdef WIN32
+#pragma warning( disable : 4786 )
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include "scenecache.h"
+#include "read.h"
+#include "mapfile.h"
+
+#include "../scene/scene.h"
+#include "../scene/light.h"
+#include "../SceneObjects/trimesh.h"
+#include "../SceneObjects/trikernel.h"
+#include "../SceneObjects/Box.h"
+#include "../SceneObjects/Cone.h"
+#include "../SceneObjects/Cylinder.h"
+#include "../SceneObjects/Sphere.h"
+#include "../SceneObjects/Square.h"
+#include "../RenderStats.h"
+
+// Bump this whenever a record below or the order of the blocks changes.
+static const unsigned int CACHE_VERSION = 3;
+static const char CACHE_MAGIC[ 8 ] = { 'S', 'B', 'T', '-', 'R', 'A', 'Y', 'C' };
+static const unsigned int BYTE_ORDER_MARK = 0x01020304;
+
+struct CacheHeader
+{
+	char magic[ 8 ];
+	unsigned int version;
+	unsigned int byteOrder;
+	unsigned long long sourceSize;
+	unsigned long long sourceHash;
+	int kernelWidth;		// the meshes' leaves are sized for it
+	int unused;
+};
+
+struct CachedCamera
+{
+	double m[ 9 ];
+	double normalizedHeight, aspectRatio;
+	double eye[ 3 ], look[ 3 ], u[ 3 ], v[ 3 ];
+};
+
+struct CachedMaterial
+{
+	double ke[ 3 ], ka[ 3 ], ks[ 3 ], kd[ 3 ], kr[ 3 ], kt[ 3 ];
+	double shininess, index;
+};
+
+enum { LIGHT_DIRECTIONAL, LIGHT_POINT };
+
+struct CachedLight
+{
+	int type;
+	int unused;
+	double v[ 3 ];			// the direction or the position
+	double color[ 3 ];
+};
+
+enum { OBJ_SPHERE, OBJ_BOX, OBJ_CYLINDER, OBJ_CONE, OBJ_SQUARE, OBJ_TRIMESH };
+
+// Every object has one of these.  Meshes that are instances of one
+// another share a shape, and each shape's buffers follow in blocks of
+// their own, in the order the shapes are numbered.
+struct CachedObject
+{
+	int type;
+	int transform;			// index into the transform block
+	int material;			// index into the material block
+	int capped;				// cones and cylinders
+	int shape;				// meshes: shapes are numbered in the order they come
+	int unused;
+	double height, bottomRadius, topRadius;		// cones
+};
+
+struct CachedBounds
+{
+	double min[ 3 ], max[ 3 ];
+};
+
+static const size_t CACHE_ALIGN = 16;
+
+static void toArray( const vec3f& v, double *a )
+{
+	a[0] = v[0];
+	a[1] = v[1];
+	a[2] = v[2];
+}
+
+static vec3f fromArray( const double *a )
+{
+	return vec3f( a[0], a[1], a[2] );
+}
+
+static CachedMaterial toCached( const Material& m )
+{
+	CachedMaterial c;
+	toArray( m.ke, c.ke );
+	toArray( m.ka, c.ka );
+	toArray( m.ks, c.ks );
+	toArray( m.kd, c.kd );
+	toArray( m.kr, c.kr );
+	toArray( m.kt, c.kt );
+	c.shininess = m.shininess;
+	c.index = m.index;
+	return c;
+}
+
+static Material *fromCached( const CachedMaterial& c )
+{
+	return new Material( fromArray( c.ke ), fromArray( c.ka ), fromArray( c.ks ),
+		fromArray( c.kd ), fromArray( c.kr ), fromArray( c.kt ), c.shininess, c.index );
+}
+
+// Writes the blocks of a cache file.  Any failed write sticks in ok.
+class CacheWriter
+{
+public:
+	CacheWriter( FILE *file )
+		: f( file ), pos( 0 ), ok( true ) {}
+
+	void write( const void *p, size_t bytes )
+	{
+		if( bytes && fwrite( p, 1, bytes, f ) != bytes )
+			ok = false;
+		pos += bytes;
+	}
+
+	void align()
+	{
+		static const char zeros[ CACHE_ALIGN ] = { 0 };
+		write( zeros, (CACHE_ALIGN - pos % CACHE_ALIGN) % CACHE_ALIGN );
+	}
+
+	template <class T>
+	void block( const T *p, size_t count )
+	{
+		unsigned long long bytes = count * sizeof( T );
+		write( &bytes, sizeof( bytes ) );
+		align();
+		write( p, (size_t)bytes );
+		align();
+	}
+
+	template <class T>
+	void block( const vector<T>& v )
+	{
+		block( v.empty() ? (const T*)NULL : &v[0], v.size() );
+	}
+
+	bool good() const { return ok; }
+
+private:
+	FILE *f;
+	size_t pos;
+	bool ok;
+};
+
+// Walks the blocks of a mapped cache file.  A block that doesn't fit
+// the file or its record size clears ok, and every later read fails.
+class CacheReader
+{
+public:
+	CacheReader( const char *begin, const char *end )
+		: base( begin ), cur( begin ), last( end ), ok( true ) {}
+
+	// step over count bytes that were read some other way
+	void skip( size_t count )
+	{
+		cur = count > size_t( last - cur ) ? last : cur + count;
+	}
+
+	template <class T>
+	const T *block( size_t& count )
+	{
+		count = 0;
+		unsigned long long bytes;
+		if( !ok || size_t( last - cur ) < sizeof( bytes ) )
+			return fail<T>();
+		memcpy( &bytes, cur, sizeof( bytes ) );
+		cur += sizeof( bytes );
+		align();
+		if( bytes % sizeof( T ) || bytes > (unsigned long long)(last - cur) )
+			return fail<T>();
+
+		const T *p = (const T*)cur;
+		cur += bytes;
+		align();
+		count = size_t( bytes / sizeof( T ) );
+		return p;
+	}
+
+	// a block that must hold exactly one record
+	template <class T>
+	const T *single()
+	{
+		size_t n;
+		const T *p = block<T>( n );
+		if( n != 1 )
+			return fail<T>();
+		return p;
+	}
+
+	template <class T>
+	bool read( vector<T>& v )
+	{
+		size_t n;
+		const T *p = block<T>( n );
+		if( !ok )
+			return false;
+		v.assign( p, p + n );
+		return true;
+	}
+
+	bool good() const { return ok; }
+
+private:
+	void align()
+	{
+		size_t off = size_t( cur - base );
+		size_t pad = (CACHE_ALIGN - off % CACHE_ALIGN) % CACHE_ALIGN;
+		cur = pad > size_t( last - cur ) ? last : cur + pad;
+	}
+
+	template <class T>
+	const T *fail()
+	{
+		ok = false;
+		return NULL;
+	}
+
+	const char *base;
+	const char *cur;
+	const char *last;
+	bool ok;
+};
+
+string SceneCache::cacheName( const string& filename )
+{
+	return filename + "c";
+}
+
+// FNV-1a, taken a word at a time rather than a byte at a time so that
+// hashing a large scene file costs next to nothing next to loading it.
+unsigned long long SceneCache::hash( const char *begin, const char *end )
+{
+	const unsigned long long prime = 1099511628211ULL;
+	unsigned long long h = 14695981039346656037ULL;
+
+	const char *p = begin;
+	for( ; end - p >= 8; p += 8 ) {
+		unsigned long long word;
+		memcpy( &word, p, sizeof( word ) );
+		h = (h ^ word) * prime;
+	}
+	for( ; p < end; ++p )
+		h = (h ^ (unsigned char)*p) * prime;
+	return h;
+}
+
+Scene *SceneCache::readScene( const string& filename )
+{
+	unsigned long long size, sourceHash;
+	{
+		MappedFile file;
+		if( !file.open( filename ) ) {
+			cerr << "Error: couldn't read scene file " << filename << endl;
+			return NULL;
+		}
+		size = file.size();
+		sourceHash = hash( file.begin(), file.end() );
+	}
+
+	string cacheFile = cacheName( filename );
+	Scene *scene = load( cacheFile, size, sourceHash );
+	if( scene )
+		return scene;
+
+	scene = ::readScene( filename );
+	if( !scene )
+		return NULL;
+	scene->initScene();
+
+	// without a cache the next load just parses again
+	save( cacheFile, scene, size, sourceHash );
+	return scene;
+}
+
+bool SceneCache::save( const string& cacheFile, Scene *scene,
+	unsigned long long sourceSize, unsigned long long sourceHash )
+{
+	typedef vector<Geometry*>::const_iterator iter;
+
+	// number the transforms, materials and mesh shapes the objects use,
+	// and the objects themselves for the hierarchy
+	map<const TransformNode*, int> transformIds;
+	map<const Material*, int> materialIds;
+	map<const Trimesh::Shape*, int> shapeIds;
+	map<const Geometry*, int> objectIds;
+	vector<const TransformNode*> transforms;
+	vector<CachedMaterial> materials;
+	vector<CachedObject> objects;
+	vector<const Trimesh*> meshes;		// the first mesh with each shape
+
+	for( iter j = scene->objects.begin(); j != scene->objects.end(); ++j ) {
+		const Geometry *g = *j;
+		const SceneObject *so = dynamic_cast<const SceneObject*>( g );
+		if( !so )
+			return false;
+
+		CachedObject o;
+		memset( &o, 0, sizeof( o ) );
+
+		if( const Trimesh *mesh = dynamic_cast<const Trimesh*>( g ) ) {
+			o.type = OBJ_TRIMESH;
+			map<const Trimesh::Shape*, int>::iterator sh = shapeIds.find( mesh->shape );
+			if( sh == shapeIds.end() ) {
+				sh = shapeIds.insert( make_pair( (const Trimesh::Shape*)mesh->shape, (int)meshes.size() ) ).first;
+				meshes.push_back( mesh );
+			}
+			o.shape = sh->second;
+		} else if( const Cone *cone = dynamic_cast<const Cone*>( g ) ) {
+			o.type = OBJ_CONE;
+			o.capped = cone->capped;
+			o.height = cone->height;
+			o.bottomRadius = cone->b_radius;
+			o.topRadius = cone->t_radius;
+		} else if( const Cylinder *cyl = dynamic_cast<const Cylinder*>( g ) ) {
+			o.type = OBJ_CYLINDER;
+			o.capped = cyl->capped;
+		} else if( dynamic_cast<const Sphere*>( g ) ) {
+			o.type = OBJ_SPHERE;
+		} else if( dynamic_cast<const Box*>( g ) ) {
+			o.type = OBJ_BOX;
+		} else if( dynamic_cast<const Square*>( g ) ) {
+			o.type = OBJ_SQUARE;
+		} else {
+			return false;
+		}
+
+		map<const TransformNode*, int>::iterator t = transformIds.find( g->transform );
+		if( t == transformIds.end() ) {
+			t = transformIds.insert( make_pair( g->transform, (int)transforms.size() ) ).first;
+			transforms.push_back( g->transform );
+		}
+		o.transform = t->second;
+
+		const Material *m = &so->getMaterial();
+		map<const Material*, int>::iterator mi = materialIds.find( m );
+		if( mi == materialIds.end() ) {
+			mi = materialIds.insert( make_pair( m, (int)materials.size() ) ).first;
+			materials.push_back( toCached( *m ) );
+		}
+		o.material = mi->second;
+
+		objectIds[ g ] = (int)objects.size();
+		objects.push_back( o );
+	}
+
+	// the meshes' per-vertex materials go into the same table
+	vector< vector<int> > vertexMaterials( meshes.size() );
+	for( int k = 0; k < (int)meshes.size(); ++k ) {
+		const Trimesh::Materials& mats = meshes[k]->shape->materials;
+		for( int v = 0; v < (int)mats.size(); ++v ) {
+			map<const Material*, int>::iterator mi = materialIds.find( mats[v] );
+			if( mi == materialIds.end() ) {
+				mi = materialIds.insert( make_pair( (const Material*)mats[v], (int)materials.size() ) ).first;
+				materials.push_back( toCached( *mats[v] ) );
+			}
+			vertexMaterials[k].push_back( mi->second );
+		}
+	}
+
+	vector<double> matrices;
+	for( int k = 0; k < (int)transforms.size(); ++k )
+		for( int r = 0; r < 4; ++r )
+			for( int c = 0; c < 4; ++c )
+				matrices.push_back( transforms[k]->xform[r][c] );
+
+	vector<CachedLight> lights;
+	for( Scene::cliter l = scene->beginLights(); l != scene->endLights(); ++l ) {
+		CachedLight c;
+		memset( &c, 0, sizeof( c ) );
+		if( const DirectionalLight *d = dynamic_cast<const DirectionalLight*>( *l ) ) {
+			c.type = LIGHT_DIRECTIONAL;
+			toArray( d->orientation, c.v );
+			toArray( d->color, c.color );
+		} else if( const PointLight *p = dynamic_cast<const PointLight*>( *l ) ) {
+			c.type = LIGHT_POINT;
+			toArray( p->position, c.v );
+			toArray( p->color, c.color );
+		} else {
+			return false;
+		}
+		lights.push_back( c );
+	}
+
+	const Camera& cam = scene->camera;
+	CachedCamera camera;
+	for( int r = 0; r < 3; ++r )
+		for( int c = 0; c < 3; ++c )
+			camera.m[ 3*r + c ] = cam.m[r][c];
+	camera.normalizedHeight = cam.normalizedHeight;
+	camera.aspectRatio = cam.aspectRatio;
+	toArray( cam.eye, camera.eye );
+	toArray( cam.look, camera.look );
+	toArray( cam.u, camera.u );
+	toArray( cam.v, camera.v );
+
+	vector<int> bvhObjects, nonbounded;
+	for( iter j = scene->bvhobjects.begin(); j != scene->bvhobjects.end(); ++j )
+		bvhObjects.push_back( objectIds[ *j ] );
+	for( iter j = scene->nonboundedobjects.begin(); j != scene->nonboundedobjects.end(); ++j )
+		nonbounded.push_back( objectIds[ *j ] );
+
+	CachedBounds bounds;
+	toArray( scene->sceneBounds.min, bounds.min );
+	toArray( scene->sceneBounds.max, bounds.max );
+
+	// written under another name and renamed into place, so a reader
+	// never sees half a cache
+	string tmpFile = cacheFile + ".tmp";
+	FILE *f = fopen( tmpFile.c_str(), "wb" );
+	if( !f )
+		return false;
+
+	CacheHeader header;
+	memset( &header, 0, sizeof( header ) );
+	memcpy( header.magic, CACHE_MAGIC, sizeof( header.magic ) );
+	header.version = CACHE_VERSION;
+	header.byteOrder = BYTE_ORDER_MARK;
+	header.sourceSize = sourceSize;
+	header.sourceHash = sourceHash;
+	header.kernelWidth = triangleKernelWidth();
+
+	CacheWriter out( f );
+	out.write( &header, sizeof( header ) );
+	out.block( &camera, 1 );
+	out.block( matrices );
+	out.block( materials );
+	out.block( lights );
+	out.block( objects );
+	for( int k = 0; k < (int)meshes.size(); ++k ) {
+		const Trimesh::Shape *shape = meshes[k]->shape;
+		out.block( shape->positions );
+		out.block( shape->normals );
+		out.block( shape->indices );
+		out.block( vertexMaterials[k] );
+		out.block( shape->triangles );
+		out.block( shape->bvh.nodes );
+	}
+	out.block( scene->bvh.nodes );
+	out.block( bvhObjects );
+	out.block( nonbounded );
+	out.block( &bounds, 1 );
+
+	bool ok = out.good();
+	if( fclose( f ) )
+		ok = false;
+
+	if( ok ) {
+		remove( cacheFile.c_str() );
+		ok = rename( tmpFile.c_str(), cacheFile.c_str() ) == 0;
+	}
+	if( !ok )
+		remove( tmpFile.c_str() );
+	return ok;
+}
+
+Scene *SceneCache::load( const string& cacheFile, unsigned long long sourceSize,
+	unsigned long long sourceHash )
+{
+	STAT_TIMER( PARSE );
+
+	MappedFile file;
+	if( !file.open( cacheFile ) || file.size() < sizeof( CacheHeader ) )
+		return NULL;
+
+	CacheHeader header;
+	memcpy( &header, file.begin(), sizeof( header ) );
+	if( memcmp( header.magic, CACHE_MAGIC, sizeof( header.magic ) ) ||
+		header.version != CACHE_VERSION ||
+		header.byteOrder != BYTE_ORDER_MARK ||
+		header.sourceSize != sourceSize ||
+		header.sourceHash != sourceHash ||
+		header.kernelWidth != triangleKernelWidth() )
+		return NULL;
+
+	// the blocks are aligned relative to the start of the file
+	CacheReader in( file.begin(), file.end() );
+	in.skip( sizeof( header ) );
+
+	size_t transformCount, materialCount, lightCount, objectCount;
+	const CachedCamera *camera = in.single<CachedCamera>();
+	const double *matrices = in.block<double>( transformCount );
+	const CachedMaterial *materials = in.block<CachedMaterial>( materialCount );
+	const CachedLight *lights = in.block<CachedLight>( lightCount );
+	const CachedObject *objects = in.block<CachedObject>( objectCount );
+	if( !in.good() || transformCount % 16 )
+		return NULL;
+	transformCount /= 16;
+
+	Scene *scene = new Scene;
+
+	Camera& cam = scene->camera;
+	for( int r = 0; r < 3; ++r )
+		for( int c = 0; c < 3; ++c )
+			cam.m[r][c] = camera->m[ 3*r + c ];
+	cam.normalizedHeight = camera->normalizedHeight;
+	cam.aspectRatio = camera->aspectRatio;
+	cam.eye = fromArray( camera->eye );
+	cam.look = fromArray( camera->look );
+	cam.u = fromArray( camera->u );
+	cam.v = fromArray( camera->v );
+
+	// the world matrices hang straight off the root; a damaged one may
+	// not invert
+	vector<TransformNode*> transforms( transformCount );
+	try {
+		for( size_t k = 0; k < transformCount; ++k ) {
+			const double *x = matrices + 16 * k;
+			transforms[k] = scene->transformRoot.createChild( mat4f(
+				vec4f( x[0], x[1], x[2], x[3] ), vec4f( x[4], x[5], x[6], x[7] ),
+				vec4f( x[8], x[9], x[10], x[11] ), vec4f( x[12], x[13], x[14], x[15] ) ) );
+		}
+	} catch( SingularMatrixException& ) {
+		delete scene;
+		return NULL;
+	}
+
+	for( size_t k = 0; k < lightCount; ++k ) {
+		const CachedLight& c = lights[k];
+		if( c.type == LIGHT_DIRECTIONAL )
+			scene->add( new DirectionalLight( scene, fromArray( c.v ), fromArray( c.color ) ) );
+		else
+			scene->add( new PointLight( scene, fromArray( c.v ), fromArray( c.color ) ) );
+	}
+
+	vector<Trimesh*> meshes;		// the first mesh with each shape
+	for( size_t k = 0; k < objectCount; ++k ) {
+		const CachedObject& o = objects[k];
+		if( o.transform < 0 || o.transform >= (int)transformCount ||
+			o.material < 0 || o.material >= (int)materialCount ) {
+			delete scene;
+			return NULL;
+		}
+
+		Material *mat = fromCached( materials[ o.material ] );
+		TransformNode *transform = transforms[ o.transform ];
+		SceneObject *obj = NULL;
+
+		switch( o.type ) {
+		case OBJ_SPHERE:
+			obj = new Sphere( scene, mat );
+			break;
+		case OBJ_BOX:
+			obj = new Box( scene, mat );
+			break;
+		case OBJ_CYLINDER:
+			obj = new Cylinder( scene, mat, o.capped != 0 );
+			break;
+		case OBJ_CONE:
+			obj = new Cone( scene, mat, o.height, o.bottomRadius, o.topRadius, o.capped != 0 );
+			break;
+		case OBJ_SQUARE:
+			obj = new Square( scene, mat );
+			break;
+		case OBJ_TRIMESH:
+		{
+			// an instance of a shape read already, or the next shape
+			if( o.shape >= 0 && o.shape < (int)meshes.size() ) {
+				obj = new Trimesh( scene, mat, transform, *meshes[ o.shape ] );
+				break;
+			}
+			if( o.shape != (int)meshes.size() ) {
+				delete mat;
+				delete scene;
+				return NULL;
+			}
+
+			Trimesh *mesh = new Trimesh( scene, mat, transform );
+			Trimesh::Shape *shape = mesh->shape;
+			vector<int> vertexMaterials;
+			in.read( shape->positions );
+			in.read( shape->normals );
+			in.read( shape->indices );
+			in.read( vertexMaterials );
+			in.read( shape->triangles );
+			in.read( shape->bvh.nodes );
+			shape->triStride = mesh->faceCount() + TRI_PADDING;
+
+			bool ok = in.good() &&
+				shape->positions.size() % 3 == 0 && shape->indices.size() % 3 == 0 &&
+				(shape->normals.empty() || shape->normals.size() == shape->positions.size()) &&
+				(vertexMaterials.empty() || (int)vertexMaterials.size() == mesh->vertexCount()) &&
+				shape->triangles.size() == size_t( TRI_FIELDS ) * shape->triStride &&
+				shape->bvh.valid( mesh->faceCount() );
+			// the header's hash is of the .ray file, not of this one, so
+			// nothing the walks index with is taken on trust
+			for( int v = 0; ok && v < (int)shape->indices.size(); ++v ) {
+				if( shape->indices[v] < 0 || shape->indices[v] >= mesh->vertexCount() )
+					ok = false;
+			}
+			for( int v = 0; ok && v < (int)vertexMaterials.size(); ++v ) {
+				if( vertexMaterials[v] < 0 || vertexMaterials[v] >= (int)materialCount )
+					ok = false;
+				else
+					mesh->addMaterial( fromCached( materials[ vertexMaterials[v] ] ) );
+			}
+			if( !ok ) {
+				delete mesh;
+				delete scene;
+				return NULL;
+			}
+			meshes.push_back( mesh );
+			obj = mesh;
+			break;
+		}
+		default:
+			delete mat;
+			delete scene;
+			return NULL;
+		}
+
+		obj->setTransform( transform );
+		scene->add( obj );
+	}
+
+	size_t bvhCount, nonboundedCount;
+	in.read( scene->bvh.nodes );
+	const int *bvhObjects = in.block<int>( bvhCount );
+	const int *nonbounded = in.block<int>( nonboundedCount );
+	const CachedBounds *bounds = in.single<CachedBounds>();
+	if( !in.good() || !scene->bvh.valid( (int)bvhCount ) ) {
+		delete scene;
+		return NULL;
+	}
+
+	for( size_t k = 0; k < bvhCount + nonboundedCount; ++k ) {
+		int id = k < bvhCount ? bvhObjects[k] : nonbounded[ k - bvhCount ];
+		if( id < 0 || id >= (int)objectCount ) {
+			delete scene;
+			return NULL;
+		}
+		if( k < bvhCount )
+			scene->bvhobjects.push_back( scene->objects[ id ] );
+		else
+			scene->nonboundedobjects.push_back( scene->objects[ id ] );
+	}
+	scene->sceneBounds.min = fromArray( bounds->min );
+	scene->sceneBounds.max = fromArray( bounds->max );
+	scene->initialized = true;
+
+	return scene;
+}
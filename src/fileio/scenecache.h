@@ -0,0 +1,55 @@
+#ifndef __SCENECACHE_H__
+#define __SCENECACHE_H__
+
+// A binary image of a fully built scene, so that a large scene can be
+// loaded again without parsing the .ray file or building any of its
+// hierarchies.  The cache for foo.ray is foo.rayc, next to it; it
+// records a hash of the .ray file it was made from and is only used
+// while that still matches.
+//
+// The file is a header followed by blocks, each a byte count and then
+// raw records, aligned to 16 bytes.  Transforms are stored flattened
+// (the world matrix of every transform node that has objects on it),
+// materials as one table that objects refer to by index, and meshes as
+// their vertex, face and triangle kernel buffers together with their
+// face hierarchies, already in leaf order; instances of a mesh store
+// those only once.  The scene hierarchy is
+// stored too.  Loading maps the file and copies each block into place
+// in one go; nothing is rebuilt.  The format is native: the header
+// also records the byte order, and a cache written by another build
+// or on another kind of machine is just ignored.
+
+#include <string>
+
+using namespace std;
+
+class Scene;
+
+class SceneCache
+{
+public:
+	// Read the scene in filename through its cache: load the cache if
+	// it is current, otherwise parse the file, initialize the scene and
+	// (re)write the cache.  Returns NULL if the scene can't be read.
+	// The scene comes back already initialized.
+	static Scene *readScene( const string& filename );
+
+	// The cache file for a scene file.
+	static string cacheName( const string& filename );
+
+	// Load a cache file, if it was made from a source file with the
+	// given size and hash; NULL if it wasn't, or isn't a valid cache.
+	static Scene *load( const string& cacheFile, unsigned long long sourceSize,
+		unsigned long long sourceHash );
+
+	// Write an initialized scene to a cache file.  False if the scene
+	// has something in it the format can't hold, or the file can't be
+	// written.
+	static bool save( const string& cacheFile, Scene *scene,
+		unsigned long long sourceSize, unsigned long long sourceHash );
+
+	// A 64 bit hash of the bytes in [begin, end): FNV-1a, a word at a time.
+	static unsigned long long hash( const char *begin, const char *end );
+};
+
+#endif // __SCENECACHE_H__
@@ -55,7 +55,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <chrono>
 
 #include <FL/Fl.h>
 #include <FL/Fl_Window.H>
@@ -65,8 +65,9 @@
 
 #include "ui/TraceUI.h"
 #include "RayTracer.h"
+#include "RenderStats.h"
 
-#include "fileio/bitmap.h"
+#include "fileio/imagewriter.h"
 
 // ***********************************************************
 // from getopt.cpp 
@@ -84,27 +85,45 @@ TraceUI* traceUI;
 // options from program parameters
 //
 int recursion_depth = 0;
+double cutoff = 1.0 / 4096.0;
+bool bRoulette = false;
+int antialias = 0;
+int compression = 6;
+double exposure = 0.0;
+bool bSoftHighlights = false;
 int g_height;
 int g_width = 150;
+int g_threads = 1;
 bool bReport = false;
-char *progname, *rayName, *imgName;
+bool bSceneCache = true;
+char *progname, *rayName, *imgName, *statsName;
 
 void usage()
 {
 #ifdef WIN32
-	fl_alert( "usage: %s [-r <#> -w <#> -t] [input.ray output.bmp]\n", progname );
+	fl_alert( "usage: %s [-r <#> -c <#> -u -w <#> -p <#> -a <#> -z <#> -e <#> -m -t -s <file> -n] [input.ray output.bmp]\n", progname );
 #else
 	fprintf( stderr, "usage: %s [options] [input.ray output.bmp]\n", progname );
+	fprintf( stderr, "  the output format follows its extension: .bmp, .ppm, .png or .hdr\n" );
 	fprintf( stderr, "  -r <#>      set recurssion level (default %d)\n", recursion_depth );
+	fprintf( stderr, "  -c <#>      don't trace rays weighted below #, 0 = all (default %g)\n", cutoff );
+	fprintf( stderr, "  -u          Russian roulette below the cutoff instead (unbiased)\n" );
 	fprintf( stderr, "  -w <#>      set output image width (default %d)\n", g_width );
+	fprintf( stderr, "  -p <#>      render tiles on # threads, 0 = all cores (default %d)\n", g_threads );
+	fprintf( stderr, "  -a <#>      adaptive anti-aliasing levels, 0 = off (default %d)\n", antialias );
+	fprintf( stderr, "  -z <#>      PNG compression level, 0-9 (default %d)\n", compression );
+	fprintf( stderr, "  -e <#>      exposure in stops, for the 8 bit formats (default %g)\n", exposure );
+	fprintf( stderr, "  -m          roll bright colours off instead of clipping them\n" );
 	fprintf( stderr, "  -t			report time statistics\n" );
+	fprintf( stderr, "  -s <file>   write render statistics to file as JSON\n" );
+	fprintf( stderr, "  -n          don't use or write the scene cache (input.rayc)\n" );
 #endif
 }
 
 bool processArgs(int argc, char **argv) {
 	int i;
 
-    while ( (i = getopt( argc, argv, "tr:w:h:" )) != EOF )
+    while ( (i = getopt( argc, argv, "tr:c:uw:h:p:a:s:nz:e:m" )) != EOF )
 	{
 		switch ( i )
 		{
@@ -115,6 +134,14 @@ bool processArgs(int argc, char **argv) {
 			case 'r':
 			recursion_depth = atoi( optarg );
 			break;
+
+			case 'c':
+			cutoff = atof( optarg );
+			break;
+
+			case 'u':
+			bRoulette = true;
+			break;
 	    
 			case 'w':
 			g_width = atoi( optarg );
@@ -124,6 +151,34 @@ bool processArgs(int argc, char **argv) {
 			g_height = atoi( optarg );
 			break;
 
+			case 'p':
+			g_threads = atoi( optarg );
+			break;
+
+			case 'a':
+			antialias = atoi( optarg );
+			break;
+
+			case 's':
+			statsName = optarg;
+			break;
+
+			case 'n':
+			bSceneCache = false;
+			break;
+
+			case 'z':
+			compression = atoi( optarg );
+			break;
+
+			case 'e':
+			exposure = atof( optarg );
+			break;
+
+			case 'm':
+			bSoftHighlights = true;
+			break;
+
 			default:
 			return false;
 		}
@@ -160,34 +215,83 @@ int main(int argc, char **argv) {
 		}
 		
 		theRayTracer=new RayTracer();
+		theRayTracer->setSceneCache(bSceneCache);
 		theRayTracer->loadScene(rayName);
+		theRayTracer->setDepth(recursion_depth);
+		theRayTracer->setCutoff(cutoff);
+		theRayTracer->setRussianRoulette(bRoulette);
+		theRayTracer->setAntialias(antialias);
 	
 		if (theRayTracer->sceneLoaded()) {
 			g_height = (int)(g_width / theRayTracer->aspectRatio() + 0.5);
 
 			theRayTracer->traceSetup(g_width, g_height);
+			theRayTracer->setToneMap(ToneMap(bSoftHighlights ? ToneMap::REINHARD : ToneMap::CLAMP, exposure));
+
+			// with several threads the image is written out while the
+			// tiles render
+			ImageWriter *out = NULL;
+			if (g_threads != 1) {
+				out = ImageWriter::create(imgName);
+				out->setCompression(compression);
+				if (!out->open(imgName, g_width, g_height)) {
+					delete out;
+					out = NULL;
+				}
+			}
 		
-			clock_t start, end;
-			start=clock();
+			// wall time; clock() would add up the time of every thread
+			std::chrono::steady_clock::time_point start, end;
+			start=std::chrono::steady_clock::now();
 
-			theRayTracer->traceLines(0, g_height);
+			if (g_threads == 1)
+				theRayTracer->traceLines(0, g_height);
+			else
+				theRayTracer->traceTiles(g_threads, 32, out);
 		
-			end=clock();
+			end=std::chrono::steady_clock::now();
 
 			// save image
-			unsigned char* buf;
+			bool saved;
+			if (out) {
+				saved = out->close();
+				delete out;
+			} else {
+				unsigned char* buf;
+				float* rad;
 
-			theRayTracer->getBuffer(buf, g_width, g_height);
-			if (buf)
-				writeBMP(imgName, g_width, g_height, buf); 
+				theRayTracer->getBuffer(buf, g_width, g_height);
+				theRayTracer->getRadiance(rad, g_width, g_height);
+				saved = buf && writeImage(imgName, g_width, g_height, buf, compression, rad);
+			}
+			if (!saved)
+				fprintf( stderr, "can't write %s\n", imgName );
 
 			if (bReport) {
-				double t=(double)(end-start)/CLOCKS_PER_SEC;
+				double t=std::chrono::duration<double>(end-start).count();
 #ifdef WIN32
 				fl_message( "total time = %.3f seconds\n", t); 
 #else
 				fprintf( stderr, "total time = %.3f seconds\n", t); 
+#ifdef RAY_STATS
+				RenderStats::total().print( stderr );
 #endif
+#endif
+			}
+
+			// the counters are only there with RAY_STATS; without it the
+			// file just has zeros.
+			if (statsName) {
+				FILE *f = fopen(statsName, "w");
+				if (f) {
+					fprintf( f, "{\n  \"render_seconds\": %.6f,\n",
+						std::chrono::duration<double>(end-start).count() );
+					RenderStats::total().writeJSON( f, "  " );
+					fprintf( f, "}\n" );
+					fclose( f );
+				} else {
+					fprintf( stderr, "can't write %s\n", statsName );
+				}
 			}
 		}
 
@@ -0,0 +1,354 @@
+#include <cmath>
+#include <float.h>
+
+#include "bvh.h"
+
+void BoundingBox::operator=(const BoundingBox& target)
+{
+	min = target.min;
+	max = target.max;
+}
+
+// Does this bounding box intersect the target?
+bool BoundingBox::intersects(const BoundingBox &target) const
+{
+	return ((target.min[0] - RAY_EPSILON <= max[0]) && (target.max[0] + RAY_EPSILON >= min[0]) &&
+			(target.min[1] - RAY_EPSILON <= max[1]) && (target.max[1] + RAY_EPSILON >= min[1]) &&
+			(target.min[2] - RAY_EPSILON <= max[2]) && (target.max[2] + RAY_EPSILON >= min[2]));
+}
+
+// does the box contain this point?
+bool BoundingBox::intersects(const vec3f& point) const
+{
+	return ((point[0] + RAY_EPSILON >= min[0]) && (point[1] + RAY_EPSILON >= min[1]) && (point[2] + RAY_EPSILON >= min[2]) &&
+		 (point[0] - RAY_EPSILON <= max[0]) && (point[1] - RAY_EPSILON <= max[1]) && (point[2] - RAY_EPSILON <= max[2]));
+}
+
+// if the ray hits the box, put the "t" value of the intersection
+// closest to the origin in tMin and the "t" value of the far intersection
+// in tMax and return true, else return false.
+// Using Kay/Kajiya algorithm, with the slabs ordered by the sign of the
+// direction.  Along an axis the ray is parallel to, the reciprocal is
+// infinite: the slab then either holds the origin and cuts nothing or
+// cuts everything.  A ray lying in the plane of a face makes 0 * inf =
+// NaN, which fails both comparisons and leaves that slab out.
+bool BoundingBox::intersect(const ray& r, double& tMin, double& tMax) const
+{
+	vec3f R0 = r.getPosition();
+	vec3f Rd = r.getDirection();
+
+	tMin = -1.0e308; // 1.0e308 is close to infinity... close enough for us!
+	tMax = 1.0e308;
+
+	for (int currentaxis = 0; currentaxis < 3; currentaxis++)
+	{
+		double inv = 1.0 / Rd[currentaxis];
+		bool neg = inv < 0.0;
+
+		// two slab intersections, near one first
+		double t1 = ((neg ? max : min)[currentaxis] - R0[currentaxis]) * inv;
+		double t2 = ((neg ? min : max)[currentaxis] - R0[currentaxis]) * inv;
+
+		tMin = t1 > tMin ? t1 : tMin;
+		tMax = t2 < tMax ? t2 : tMax;
+	}
+	return tMin <= tMax && tMax >= 0.0;
+}
+
+void BoundingBox::merge(const BoundingBox& target)
+{
+	min = minimum(min, target.min);
+	max = maximum(max, target.max);
+}
+
+void BoundingBox::merge(const vec3f& point)
+{
+	min = minimum(min, point);
+	max = maximum(max, point);
+}
+
+double BoundingBox::area() const
+{
+	vec3f d = max - min;
+	return 2.0 * (d[0]*d[1] + d[1]*d[2] + d[2]*d[0]);
+}
+
+// Parameters of the surface area heuristic.  Costs are relative to one
+// primitive intersection test.
+static const int	BVH_BINS = 16;
+static const int	BVH_MAX_LEAF = 4;
+static const int	BVH_MAX_DEPTH = 60;		// the traversal stacks are sized for it
+static const double BVH_TRAVERSAL_COST = 1.0;
+
+void BVH::clear()
+{
+	nodes.clear();
+}
+
+void BVH::build( const vector<BoundingBox>& boxes, vector<int>& order,
+	int leafWidth )
+{
+	clear();
+	order.clear();
+	if( boxes.empty() )
+		return;
+
+	vector<BuildItem> items( boxes.size() );
+	for( int i = 0; i < (int)boxes.size(); ++i ) {
+		items[i].bounds = boxes[i];
+		items[i].centroid = 0.5 * (boxes[i].min + boxes[i].max);
+		items[i].index = i;
+	}
+
+	vector<BuildNode> tree;
+	tree.reserve( 2 * boxes.size() );
+	if( leafWidth < 1 )
+		leafWidth = 1;
+	buildNode( tree, items, 0, (int)items.size(), 0, leafWidth );
+
+	collapse( tree, 0 );
+	nodes.shrink_to_fit();
+
+	order.resize( items.size() );
+	for( int i = 0; i < (int)items.size(); ++i )
+		order[i] = items[i].index;
+}
+
+bool BVH::valid( int count ) const
+{
+	// children come after their parents, so one pass in order sees a
+	// node's parent before the node
+	vector<int> depth( nodes.size(), -1 );
+	if( !nodes.empty() )
+		depth[0] = 0;
+
+	for( int n = 0; n < (int)nodes.size(); ++n ) {
+		if( depth[n] < 0 )
+			return false;
+
+		for( int c = 0; c < 4; ++c ) {
+			int child = nodes[n].child[c];
+			int size = nodes[n].count[c];
+			if( size > 0 ) {
+				if( child < 0 || child > count - size )
+					return false;
+			} else if( size == 0 ) {
+				if( child <= n || child >= (int)nodes.size() || depth[child] >= 0 ||
+					depth[n] >= BVH_MAX_DEPTH )
+					return false;
+				depth[child] = depth[n] + 1;
+			} else if( size != -1 ) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Round to single precision without letting the box shrink.
+static float roundDown( double x )
+{
+	float f = (float)x;
+	return f > x ? nextafterf( f, -FLT_MAX ) : f;
+}
+
+static float roundUp( double x )
+{
+	float f = (float)x;
+	return f < x ? nextafterf( f, FLT_MAX ) : f;
+}
+
+// Build the binary subtree over items[begin,end) and return the index of
+// its root node.  Splits are chosen with the surface area heuristic, evaluated
+// over BVH_BINS equal-width bins of the centroid bounds on each axis.
+int BVH::buildNode( vector<BuildNode>& tree, vector<BuildItem>& items,
+	int begin, int end, int depth, int leafWidth )
+{
+	int index = (int)tree.size();
+	tree.push_back( BuildNode() );
+
+	int n = end - begin;
+	BoundingBox bounds = items[begin].bounds;
+	BoundingBox centroids;
+	centroids.min = centroids.max = items[begin].centroid;
+	for( int i = begin + 1; i < end; ++i ) {
+		bounds.merge( items[i].bounds );
+		centroids.merge( items[i].centroid );
+	}
+	for( int axis = 0; axis < 3; ++axis ) {
+		tree[index].min[axis] = roundDown( bounds.min[axis] );
+		tree[index].max[axis] = roundUp( bounds.max[axis] );
+	}
+
+	int bestAxis = -1;
+	int bestSplit = 0;
+	double bestCost = 1.0e308;
+
+	if( n > 1 && depth < BVH_MAX_DEPTH ) {
+		for( int axis = 0; axis < 3; ++axis ) {
+			double lo = centroids.min[axis];
+			double extent = centroids.max[axis] - lo;
+			if( extent <= 0.0 )
+				continue;
+
+			int count[ BVH_BINS ] = { 0 };
+			BoundingBox binBounds[ BVH_BINS ];
+			double scale = BVH_BINS / extent;
+
+			for( int i = begin; i < end; ++i ) {
+				int b = (int)((items[i].centroid[axis] - lo) * scale);
+				if( b >= BVH_BINS )
+					b = BVH_BINS - 1;
+				if( count[b]++ == 0 )
+					binBounds[b] = items[i].bounds;
+				else
+					binBounds[b].merge( items[i].bounds );
+			}
+
+			// sweep from the right to get the cost of every right half,
+			// then from the left to combine with the left halves.
+			double rightArea[ BVH_BINS ];
+			int rightCount[ BVH_BINS ];
+			BoundingBox acc;
+			int accCount = 0;
+			for( int b = BVH_BINS - 1; b > 0; --b ) {
+				if( count[b] ) {
+					if( accCount == 0 )
+						acc = binBounds[b];
+					else
+						acc.merge( binBounds[b] );
+					accCount += count[b];
+				}
+				rightArea[b] = accCount ? acc.area() : 0.0;
+				rightCount[b] = accCount;
+			}
+
+			accCount = 0;
+			for( int b = 0; b < BVH_BINS - 1; ++b ) {
+				if( count[b] ) {
+					if( accCount == 0 )
+						acc = binBounds[b];
+					else
+						acc.merge( binBounds[b] );
+					accCount += count[b];
+				}
+				if( accCount == 0 || rightCount[b+1] == 0 )
+					continue;
+
+				double cost = accCount * acc.area() + rightCount[b+1] * rightArea[b+1];
+				if( cost < bestCost ) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = b;
+				}
+			}
+		}
+	}
+
+	// Turn the node into a leaf when no split was found or when the SAH
+	// says intersecting everything here is no worse than splitting.  The
+	// primitives of a leaf are tested leafWidth at a time.
+	int maxLeaf = leafWidth > BVH_MAX_LEAF ? leafWidth : BVH_MAX_LEAF;
+	double leafCost = (n + leafWidth - 1) / leafWidth;
+	double area = bounds.area();
+	double splitCost = area > 0.0 ? BVH_TRAVERSAL_COST + bestCost / area : 1.0e308;
+
+	if( bestAxis < 0 || (n <= maxLeaf && leafCost <= splitCost) ) {
+		tree[index].offset = begin;
+		tree[index].count = n;
+		return index;
+	}
+
+	double lo = centroids.min[bestAxis];
+	double scale = BVH_BINS / (centroids.max[bestAxis] - lo);
+	int mid = begin;
+	for( int i = begin; i < end; ++i ) {
+		int b = (int)((items[i].centroid[bestAxis] - lo) * scale);
+		if( b >= BVH_BINS )
+			b = BVH_BINS - 1;
+		if( b <= bestSplit )
+			swap( items[i], items[mid++] );
+	}
+
+	buildNode( tree, items, begin, mid, depth + 1, leafWidth );
+	int right = buildNode( tree, items, mid, end, depth + 1, leafWidth );
+
+	tree[index].offset = right;
+	tree[index].count = 0;
+	return index;
+}
+
+static double area( const float *min, const float *max )
+{
+	double dx = max[0] - min[0], dy = max[1] - min[1], dz = max[2] - min[2];
+	return 2.0 * (dx*dy + dy*dz + dz*dx);
+}
+
+// Turn the binary subtree at tree[root] into a node of the 4-wide tree
+// and return its index.  The node starts out with the root's two
+// children, and the interior child with the largest surface area, the
+// one rays reach most often, is replaced by its own two children until
+// there are four or only leaves are left.  A tree that is a single leaf
+// becomes a node with one child.
+int BVH::collapse( const vector<BuildNode>& tree, int root )
+{
+	int slots[4];
+	int n = 0;
+	if( tree[ root ].count > 0 ) {
+		slots[ n++ ] = root;
+	} else {
+		slots[ n++ ] = root + 1;
+		slots[ n++ ] = tree[ root ].offset;
+	}
+
+	while( n < 4 ) {
+		int best = -1;
+		double bestArea = -1.0;
+		for( int k = 0; k < n; ++k ) {
+			const BuildNode& node = tree[ slots[k] ];
+			double a = area( node.min, node.max );
+			if( node.count == 0 && a > bestArea ) {
+				best = k;
+				bestArea = a;
+			}
+		}
+		if( best < 0 )
+			break;
+
+		int open = slots[ best ];
+		slots[ best ] = open + 1;
+		slots[ n++ ] = tree[ open ].offset;
+	}
+
+	int index = (int)nodes.size();
+	nodes.push_back( Node() );
+
+	for( int c = 0; c < 4; ++c ) {
+		if( c >= n ) {
+			for( int axis = 0; axis < 3; ++axis ) {
+				nodes[index].bounds[0][axis][c] = FLT_MAX;
+				nodes[index].bounds[1][axis][c] = -FLT_MAX;
+			}
+			nodes[index].child[c] = 0;
+			nodes[index].count[c] = -1;
+			continue;
+		}
+
+		const BuildNode& node = tree[ slots[c] ];
+		for( int axis = 0; axis < 3; ++axis ) {
+			nodes[index].bounds[0][axis][c] = node.min[axis];
+			nodes[index].bounds[1][axis][c] = node.max[axis];
+		}
+		if( node.count > 0 ) {
+			nodes[index].child[c] = node.offset;
+			nodes[index].count[c] = node.count;
+		} else {
+			// nodes may move while the subtree is added
+			int child = collapse( tree, slots[c] );
+			nodes[index].child[c] = child;
+			nodes[index].count[c] = 0;
+		}
+	}
+
+	return index;
+}
@@ -0,0 +1,563 @@
+//
+// bvh.h
+//
+// Axis-aligned bounding boxes and a bounding volume hierarchy built over
+// them.  The hierarchy only knows about boxes and integer primitive
+// indices, so the same structure can sit behind Scene::intersect or inside
+// a single primitive.
+//
+
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <float.h>
+
+#include <vector>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define BVH_SSE2
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+#include "ray.h"
+#include "../vecmath/vecmath.h"
+#include "../RenderStats.h"
+
+class BoundingBox
+{
+public:
+	vec3f min;
+	vec3f max;
+
+	void operator=(const BoundingBox& target);
+
+	// Does this bounding box intersect the target?
+	bool intersects(const BoundingBox &target) const;
+
+	// does the box contain this point?
+	bool intersects(const vec3f& point) const;
+
+	// if the ray hits the box, put the "t" value of the intersection
+	// closest to the origin in tMin and the "t" value of the far intersection
+	// in tMax and return true, else return false.
+	bool intersect(const ray& r, double& tMin, double& tMax) const;
+
+	// grow this box so that it also encloses the target / the point.
+	void merge(const BoundingBox& target);
+	void merge(const vec3f& point);
+
+	// surface area of the box; used by the SAH cost function.
+	double area() const;
+};
+
+// A ray set up for slab tests against many boxes: its origin, the
+// reciprocal of its direction and which way it points along each axis,
+// all worked out once per ray, so that testing a slab costs a subtract
+// and a multiply.  Along an axis the ray is parallel to, the reciprocal
+// is an infinity with the sign of the (possibly negative) zero.
+struct BoxRay
+{
+	float org[3];
+	float inv[3];
+	int sign[3];		// 1 where the ray points towards -axis
+
+	BoxRay() {}
+	BoxRay( const ray& r );
+};
+
+inline BoxRay::BoxRay( const ray& r )
+{
+	vec3f p = r.getPosition();
+	vec3f d = r.getDirection();
+	for( int axis = 0; axis < 3; ++axis ) {
+		org[axis] = p[axis];
+		inv[axis] = 1.0f / d[axis];
+		sign[axis] = inv[axis] < 0.0f;
+	}
+}
+
+class BVH
+{
+public:
+	// The hierarchy is 4-wide: a node holds the boxes of up to four
+	// children, one array of four per bound and axis, so that a ray is
+	// tested against all of them with one SIMD operation per slab.  A
+	// child with a count above 0 is a leaf, the run of 'count' primitives
+	// from 'child' in leaf order; a count of 0 makes 'child' the index of
+	// another node, and -1 marks an unused slot (those come last and have
+	// inverted bounds).  Nodes are stored depth first, the root first.
+	// The bounds are kept in single precision, rounded outwards.
+	struct Node
+	{
+		float bounds[2][3][4];		// [min, max][axis][child]
+		int child[4];
+		int count[4];
+	};
+
+	BVH() {}
+
+	// Build the hierarchy over the given boxes.  Afterwards order[k] is
+	// the index (into boxes) of the k-th primitive in leaf order; the
+	// caller is expected to store its primitives in that order.
+	// leafWidth is the number of primitives the caller tests at once
+	// (e.g. the SIMD width of its intersection kernel); leaves may grow
+	// to that size and are costed per batch rather than per primitive.
+	void build( const vector<BoundingBox>& boxes, vector<int>& order,
+		int leafWidth = 1 );
+	void clear();
+
+	bool empty() const { return nodes.empty(); }
+	int nodeCount() const { return (int)nodes.size(); }
+
+	// Could build() have made these nodes over count primitives?  For
+	// hierarchies read from outside, e.g. a scene cache: every child is
+	// a node after its parent or a leaf inside [0, count), each node has
+	// one parent, and the tree is no deeper than the walks' stacks allow.
+	bool valid( int count ) const;
+
+	// Walk the hierarchy front to back.  visit( k, tMax ) is called for
+	// every leaf entry k whose node the ray reaches before tMax; it must
+	// return true and shrink tMax when it records a closer hit.  Nodes
+	// that start beyond the current tMax are skipped.
+	template <class Visitor>
+	bool traverse( const ray& r, double tMax, Visitor& visit ) const;
+
+	// As traverse(), but visit( first, count, tMax ) is called once per
+	// leaf with the run of leaf entries [first, first+count).
+	template <class LeafVisitor>
+	bool traverseLeaves( const ray& r, double tMax, LeafVisitor& visit ) const;
+
+	// Any-hit walk for occlusion queries.  visit( k, tMax ) returns true
+	// if entry k blocks the ray before tMax, and the walk stops right
+	// there; tMax never shrinks, so children are not sorted.
+	template <class Visitor>
+	bool traverseAny( const ray& r, double tMax, Visitor& visit ) const;
+
+	// As traverseAny(), with visit( first, count, tMax ) called per leaf.
+	template <class LeafVisitor>
+	bool traverseAnyLeaves( const ray& r, double tMax, LeafVisitor& visit ) const;
+
+	// Walk the hierarchy with PACKET_SIZE rays at once, sharing the node
+	// fetches and testing the boxes for all rays together.  Only the
+	// rays whose bit is set in mask take part.  visit( lane, first,
+	// count, tMax ) is called like the traverseLeaves() visitor, for one
+	// ray of the packet at a time; tMax[lane] is that ray's limit.  Once
+	// a subtree is only reached by a single ray, it is finished with the
+	// single ray traversal.  Returns the mask of rays that hit something.
+	enum { PACKET_SIZE = 4 };
+
+	template <class PacketVisitor>
+	int traversePacket( const ray *rays, double *tMax, int mask,
+		PacketVisitor& visit ) const;
+
+private:
+	struct BuildItem
+	{
+		BoundingBox bounds;
+		vec3f centroid;
+		int index;
+	};
+
+	// The binary tree the SAH build produces, stored like the 4-wide
+	// one: the left child follows its parent and 'offset' is the right
+	// child, or the first primitive of a leaf.
+	struct BuildNode
+	{
+		float min[3];
+		float max[3];
+		int offset;
+		int count;
+	};
+
+	int buildNode( vector<BuildNode>& tree, vector<BuildItem>& items,
+		int begin, int end, int depth, int leafWidth );
+	int collapse( const vector<BuildNode>& tree, int root );
+
+	// Every level of a walk leaves at most three siblings on the stack,
+	// and the tree is no deeper than the binary one it was built from.
+	enum { STACK_SIZE = 192 };
+
+	// slab test of a ray against the children of a node; returns a bit
+	// for each child it reaches within [0, tMax] and their entry points
+	// in tNear.
+	static int intersectChildren( const Node& node, const BoxRay& r,
+		double tMax, float *tNear );
+
+	// the rays of a packet, one array of PACKET_SIZE per coordinate
+	struct Packet
+	{
+		double p[3][ PACKET_SIZE ];
+		double inv[3][ PACKET_SIZE ];
+	};
+
+	// slab test of the rays in mask against child c of a node; returns
+	// the rays that reach it before their tMax and their entry points in
+	// tNear.
+	static int intersectChild( const Node& node, int c, const Packet& packet,
+		const double *tMax, int mask, double *tNear );
+
+	// the single ray walk below a child reference (see Node); tMax
+	// shrinks with the hits found
+	template <class LeafVisitor>
+	bool traverseFrom( int child, int count, double tNear, const BoxRay& r,
+		double& tMax, LeafVisitor& visit ) const;
+
+	vector<Node> nodes;
+
+	friend class SceneCache;
+};
+
+// The far end of every slab test is pushed out by 2 gamma(3), the most
+// that rounding in the float arithmetic can pull it in, so that a ray
+// grazing a box is never culled by it.
+static const float BVH_FAR_SCALE = 1.0f + 3.0f * FLT_EPSILON;
+
+// The near and far planes are picked by the sign of the direction, so
+// nothing needs swapping and an empty slot, whose min is above its max,
+// can never be entered.  A ray that is parallel to a slab and lies in
+// one of its planes makes 0 * inf = NaN; max and min return their
+// second operand when either is a NaN, so such a slab is simply left
+// out, which treats the ray as inside it.
+inline int BVH::intersectChildren( const Node& node, const BoxRay& r,
+	double tMax, float *tNear )
+{
+#ifdef RAY_STATS
+	int used = 0;
+	while( used < 4 && node.count[ used ] >= 0 )
+		++used;
+	STAT_ADD( boxTests, used );
+#endif
+
+	float tFar = tMax < FLT_MAX ? (float)tMax : FLT_MAX;
+
+#ifdef BVH_SSE2
+	__m128 lo = _mm_setzero_ps();
+	__m128 hi = _mm_set1_ps( tFar );
+	for( int axis = 0; axis < 3; ++axis ) {
+		__m128 org = _mm_set1_ps( r.org[axis] );
+		__m128 inv = _mm_set1_ps( r.inv[axis] );
+		__m128 t0 = _mm_loadu_ps( node.bounds[ r.sign[axis] ][axis] );
+		__m128 t1 = _mm_loadu_ps( node.bounds[ 1 - r.sign[axis] ][axis] );
+		lo = _mm_max_ps( _mm_mul_ps( _mm_sub_ps( t0, org ), inv ), lo );
+		hi = _mm_min_ps( _mm_mul_ps( _mm_sub_ps( t1, org ), inv ), hi );
+	}
+	hi = _mm_mul_ps( hi, _mm_set1_ps( BVH_FAR_SCALE ) );
+	_mm_storeu_ps( tNear, lo );
+	return _mm_movemask_ps( _mm_cmple_ps( lo, hi ) );
+#else
+	int hit = 0;
+	for( int c = 0; c < 4; ++c ) {
+		float lo = 0.0f, hi = tFar;
+		for( int axis = 0; axis < 3; ++axis ) {
+			float t0 = (node.bounds[ r.sign[axis] ][axis][c] - r.org[axis]) * r.inv[axis];
+			float t1 = (node.bounds[ 1 - r.sign[axis] ][axis][c] - r.org[axis]) * r.inv[axis];
+			lo = t0 > lo ? t0 : lo;
+			hi = t1 < hi ? t1 : hi;
+		}
+		tNear[c] = lo;
+		if( lo <= hi * BVH_FAR_SCALE )
+			hit |= 1 << c;
+	}
+	return hit;
+#endif
+}
+
+// The same test for up to PACKET_SIZE rays against one box.  The rays
+// point different ways, so each picks its near and far plane with a
+// mask instead of an index.
+inline int BVH::intersectChild( const Node& node, int c, const Packet& packet,
+	const double *tMax, int mask, double *tNear )
+{
+	int hit = 0;
+
+#ifdef BVH_SSE2
+	// two rays per step
+	const __m128d zero = _mm_setzero_pd();
+	const __m128d scale = _mm_set1_pd( BVH_FAR_SCALE );
+	for( int lane = 0; lane < PACKET_SIZE; lane += 2 ) {
+		if( !(mask & (3 << lane)) )
+			continue;
+		STAT_ADD( boxTests, ((mask >> lane) & 1) + ((mask >> (lane + 1)) & 1) );
+
+		__m128d lo = zero;
+		__m128d hi = _mm_loadu_pd( tMax + lane );
+		for( int axis = 0; axis < 3; ++axis ) {
+			__m128d p = _mm_loadu_pd( &packet.p[axis][lane] );
+			__m128d inv = _mm_loadu_pd( &packet.inv[axis][lane] );
+			__m128d neg = _mm_cmplt_pd( inv, zero );
+			__m128d t0 = _mm_mul_pd( _mm_sub_pd( _mm_set1_pd( node.bounds[0][axis][c] ), p ), inv );
+			__m128d t1 = _mm_mul_pd( _mm_sub_pd( _mm_set1_pd( node.bounds[1][axis][c] ), p ), inv );
+			__m128d tn = _mm_or_pd( _mm_and_pd( neg, t1 ), _mm_andnot_pd( neg, t0 ) );
+			__m128d tf = _mm_or_pd( _mm_and_pd( neg, t0 ), _mm_andnot_pd( neg, t1 ) );
+			lo = _mm_max_pd( tn, lo );
+			hi = _mm_min_pd( tf, hi );
+		}
+		hi = _mm_mul_pd( hi, scale );
+		_mm_storeu_pd( tNear + lane, lo );
+		hit |= _mm_movemask_pd( _mm_cmple_pd( lo, hi ) ) << lane;
+	}
+#else
+	for( int lane = 0; lane < PACKET_SIZE; ++lane ) {
+		if( !(mask & (1 << lane)) )
+			continue;
+		STAT_ADD( boxTests, 1 );
+
+		double lo = 0.0, hi = tMax[lane];
+		for( int axis = 0; axis < 3; ++axis ) {
+			double inv = packet.inv[axis][lane];
+			int near = inv < 0.0;
+			double t0 = (node.bounds[ near ][axis][c] - packet.p[axis][lane]) * inv;
+			double t1 = (node.bounds[ 1 - near ][axis][c] - packet.p[axis][lane]) * inv;
+			lo = t0 > lo ? t0 : lo;
+			hi = t1 < hi ? t1 : hi;
+		}
+		tNear[lane] = lo;
+		if( lo <= hi * BVH_FAR_SCALE )
+			hit |= 1 << lane;
+	}
+#endif
+
+	return hit & mask;
+}
+
+// Adapts a per-entry visitor to traverseLeaves().
+template <class Visitor>
+struct BVHEntryVisitor
+{
+	Visitor& visit;
+
+	BVHEntryVisitor( Visitor& v ) : visit( v ) {}
+
+	bool operator()( int first, int count, double& tMax )
+	{
+		bool hit = false;
+		for( int k = first; k < first + count; ++k ) {
+			if( visit( k, tMax ) )
+				hit = true;
+		}
+		return hit;
+	}
+};
+
+template <class Visitor>
+bool BVH::traverse( const ray& r, double tMax, Visitor& visit ) const
+{
+	BVHEntryVisitor<Visitor> leaves( visit );
+	return traverseLeaves( r, tMax, leaves );
+}
+
+template <class LeafVisitor>
+bool BVH::traverseLeaves( const ray& r, double tMax, LeafVisitor& visit ) const
+{
+	if( nodes.empty() )
+		return false;
+
+	return traverseFrom( 0, 0, 0.0, BoxRay( r ), tMax, visit );
+}
+
+template <class LeafVisitor>
+bool BVH::traverseFrom( int child, int count, double tNear, const BoxRay& r,
+	double& tMax, LeafVisitor& visit ) const
+{
+	struct Entry { int child; int count; double tNear; };
+	Entry stack[ STACK_SIZE ];
+	int top = 0;
+	bool hit = false;
+
+	stack[ top ].child = child;
+	stack[ top ].count = count;
+	stack[ top ].tNear = tNear;
+	++top;
+
+	while( top > 0 ) {
+		Entry entry = stack[ --top ];
+		if( entry.tNear > tMax )
+			continue;
+
+		if( entry.count > 0 ) {
+			if( visit( entry.child, entry.count, tMax ) )
+				hit = true;
+			continue;
+		}
+
+		const Node& node = nodes[ entry.child ];
+		float near[4];
+		int mask = intersectChildren( node, r, tMax, near );
+
+		// push the children far to near, so that the nearest is popped next
+		int first = top;
+		for( int c = 0; c < 4 && node.count[c] >= 0; ++c ) {
+			if( !(mask & (1 << c)) )
+				continue;
+			int k = top++;
+			while( k > first && stack[ k - 1 ].tNear < near[c] ) {
+				stack[k] = stack[ k - 1 ];
+				--k;
+			}
+			stack[k].child = node.child[c];
+			stack[k].count = node.count[c];
+			stack[k].tNear = near[c];
+		}
+	}
+
+	return hit;
+}
+
+template <class Visitor>
+bool BVH::traverseAny( const ray& r, double tMax, Visitor& visit ) const
+{
+	BVHEntryVisitor<Visitor> leaves( visit );
+	return traverseAnyLeaves( r, tMax, leaves );
+}
+
+template <class LeafVisitor>
+bool BVH::traverseAnyLeaves( const ray& r, double tMax, LeafVisitor& visit ) const
+{
+	if( nodes.empty() )
+		return false;
+
+	BoxRay boxRay( r );
+	int stack[ STACK_SIZE ];
+	int top = 0;
+	stack[ top++ ] = 0;
+
+	while( top > 0 ) {
+		const Node& node = nodes[ stack[ --top ] ];
+		float near[4];
+		int mask = intersectChildren( node, boxRay, tMax, near );
+
+		for( int c = 0; c < 4 && node.count[c] >= 0; ++c ) {
+			if( !(mask & (1 << c)) )
+				continue;
+			if( node.count[c] == 0 )
+				stack[ top++ ] = node.child[c];
+			else if( visit( node.child[c], node.count[c], tMax ) )
+				return true;
+		}
+	}
+
+	return false;
+}
+
+// Binds a packet visitor to one ray of the packet, for the single ray
+// traversal.
+template <class PacketVisitor>
+struct BVHLaneVisitor
+{
+	PacketVisitor& visit;
+	int lane;
+
+	BVHLaneVisitor( PacketVisitor& v, int l ) : visit( v ), lane( l ) {}
+
+	bool operator()( int first, int count, double& tMax )
+	{
+		return visit( lane, first, count, tMax );
+	}
+};
+
+template <class PacketVisitor>
+int BVH::traversePacket( const ray *rays, double *tMax, int mask,
+	PacketVisitor& visit ) const
+{
+	if( nodes.empty() || !mask )
+		return 0;
+
+	int first = 0;
+	while( !(mask & (1 << first)) )
+		++first;
+
+	// unused lanes get a copy of a real ray, so they compute nothing
+	// strange; their bit is never set anyway
+	BoxRay lanes[ PACKET_SIZE ];
+	Packet packet;
+	for( int lane = 0; lane < PACKET_SIZE; ++lane ) {
+		lanes[lane] = BoxRay( rays[ (mask & (1 << lane)) ? lane : first ] );
+		for( int axis = 0; axis < 3; ++axis ) {
+			packet.p[axis][lane] = lanes[lane].org[axis];
+			packet.inv[axis][lane] = lanes[lane].inv[axis];
+		}
+	}
+
+	struct Entry { int child; int count; int mask; double tNear[ PACKET_SIZE ]; };
+	Entry stack[ STACK_SIZE ];
+	int top = 0;
+	int hit = 0;
+
+	stack[ top ].child = 0;
+	stack[ top ].count = 0;
+	stack[ top ].mask = mask;
+	for( int lane = 0; lane < PACKET_SIZE; ++lane )
+		stack[ top ].tNear[lane] = 0.0;
+	++top;
+
+	while( top > 0 ) {
+		Entry entry = stack[ --top ];
+
+		// drop the rays that have found something closer since the push
+		int live = entry.mask;
+		for( int lane = 0; lane < PACKET_SIZE; ++lane ) {
+			if( (live & (1 << lane)) && entry.tNear[lane] > tMax[lane] )
+				live &= ~(1 << lane);
+		}
+		if( !live )
+			continue;
+
+		// a single ray left: no point in carrying the packet along
+		if( !(live & (live - 1)) ) {
+			int lane = 0;
+			while( !(live & (1 << lane)) )
+				++lane;
+			BVHLaneVisitor<PacketVisitor> single( visit, lane );
+			if( traverseFrom( entry.child, entry.count, entry.tNear[lane], lanes[lane],
+					tMax[lane], single ) )
+				hit |= 1 << lane;
+			continue;
+		}
+
+		if( entry.count > 0 ) {
+			for( int lane = 0; lane < PACKET_SIZE; ++lane ) {
+				if( (live & (1 << lane)) &&
+					visit( lane, entry.child, entry.count, tMax[lane] ) )
+					hit |= 1 << lane;
+			}
+			continue;
+		}
+
+		// visit first the child that the closest of its rays enters
+		// first: sort the children that are reached by that, then push
+		// them far to near
+		const Node& node = nodes[ entry.child ];
+		Entry children[4];
+		double order[4];
+		int n = 0;
+		for( int c = 0; c < 4 && node.count[c] >= 0; ++c ) {
+			Entry& e = children[n];
+			e.mask = intersectChild( node, c, packet, tMax, live, e.tNear );
+			if( !e.mask )
+				continue;
+			e.child = node.child[c];
+			e.count = node.count[c];
+
+			double near = 1.0e308;
+			for( int lane = 0; lane < PACKET_SIZE; ++lane ) {
+				if( (e.mask & (1 << lane)) && e.tNear[lane] < near )
+					near = e.tNear[lane];
+			}
+			int k = n++;
+			while( k > 0 && order[ k - 1 ] > near ) {
+				swap( children[k], children[ k - 1 ] );
+				order[k] = order[ k - 1 ];
+				--k;
+			}
+			order[k] = near;
+		}
+		while( n > 0 )
+			stack[ top++ ] = children[ --n ];
+	}
+
+	return hit;
+}
+
+#endif // __BVH_H__
@@ -7,14 +7,15 @@ class Camera
 {
 public:
     Camera();
-    void rayThrough( double x, double y, ray &r );
+    void rayThrough( double x, double y, ray &r ) const;
     void setEye( const vec3f &eye );
     void setLook( double, double, double, double );
     void setLook( const vec3f &viewDir, const vec3f &upDir );
     void setFOV( double );
     void setAspectRatio( double );
 
-    double getAspectRatio() { return aspectRatio; }
+    double getAspectRatio() const { return aspectRatio; }
+    const vec3f& getEye() const { return eye; }
 private:
     mat3f m;                     // rotation matrix
     double normalizedHeight;    // dimensions of image place at unit dist from eye
@@ -25,6 +26,8 @@ private:
     vec3f eye;
     vec3f look;                  // direction to look
     vec3f u,v;                   // u and v in the 
+
+    friend class SceneCache;
 };
 
 #endif
@@ -11,8 +11,9 @@ double DirectionalLight::distanceAttenuation( const vec3f& P ) const
 
 vec3f DirectionalLight::shadowAttenuation( const vec3f& P ) const
 {
-    // YOUR CODE HERE:
-    // You should implement shadow-handling code here.
+    // the light is infinitely far away, so anything along the way blocks it
+    if( scene->occluded( ray( P, -orientation ), 1.0e308 ) )
+        return vec3f(0,0,0);
     return vec3f(1,1,1);
 }
 
@@ -51,7 +52,10 @@ vec3f PointLight::getDirection( const vec3f& P ) const
 
 vec3f PointLight::shadowAttenuation(const vec3f& P) const
 {
-    // YOUR CODE HERE:
-    // You should implement shadow-handling code here.
+    // only blockers between P and the light itself count
+    vec3f d = position - P;
+    double dist = d.length();
+    if( scene->occluded( ray( P, d / dist ), dist ) )
+        return vec3f(0,0,0);
     return vec3f(1,1,1);
 }
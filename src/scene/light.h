@@ -12,11 +12,18 @@ public:
 	virtual vec3f getColor( const vec3f& P ) const = 0;
 	virtual vec3f getDirection( const vec3f& P ) const = 0;
 
+	// The light's colour, which its intensity at every point is scaled
+	// by.  It can be changed between renders of an initialized scene.
+	const vec3f& getIntensity() const { return color; }
+	void setIntensity( const vec3f& col ) { color = col; }
+
 protected:
 	Light( Scene *scene, const vec3f& col )
 		: SceneElement( scene ), color( col ) {}
 
 	vec3f 		color;
+
+	friend class SceneCache;
 };
 
 class DirectionalLight
@@ -32,6 +39,8 @@ public:
 
 protected:
 	vec3f 		orientation;
+
+	friend class SceneCache;
 };
 
 class PointLight
@@ -47,6 +56,8 @@ public:
 
 protected:
 	vec3f position;
+
+	friend class SceneCache;
 };
 
 #endif // __LIGHT_H__
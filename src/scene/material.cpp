@@ -1,11 +1,14 @@
 #include "ray.h"
 #include "material.h"
 #include "light.h"
+#include "../RenderStats.h"
 
 // Apply the phong model to this point on the surface of the object, returning
 // the color of that point.
 vec3f Material::shade( Scene *scene, const ray& r, const isect& i ) const
 {
+	STAT_TIMER_FINE( SHADE );
+
 	// YOUR CODE HERE
 
 	// For now, this method just returns the diffuse color of the object.
@@ -2,8 +2,8 @@
 #include "material.h"
 #include "scene.h"
 
-const Material &
+Material
 isect::getMaterial() const
 {
-    return material ? *material : obj->getMaterial();
+    return obj->getMaterial( *this );
 }
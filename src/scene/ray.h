@@ -37,56 +37,35 @@ protected:
 	vec3f d;
 };
 
-// The description of an intersection point.
+// The description of an intersection point.  It is a plain value with no
+// owned resources, so Scene::intersect can copy candidate hits freely.
+// Objects whose material varies across their surface record where they
+// were hit (bary) and only build the interpolated Material when
+// getMaterial() is called on the final, closest hit.
 
 class isect
 {
 public:
     isect()
-        : obj( NULL ), t( 0.0 ), N(), material(0) {}
+        : obj( NULL ), t( 0.0 ), N(), bary(), face( -1 ) {}
 
-    ~isect()
-    {
-        delete material;
-    }
-    
     void setObject( SceneObject *o ) { obj = o; }
     void setT( double tt ) { t = tt; }
     void setN( const vec3f& n ) { N = n; }
-    void setMaterial( Material *m ) { delete material; material = m; }
-        
-    isect& operator =( const isect& other )
-    {
-        if( this != &other )
-        {
-            obj = other.obj;
-            t = other.t;
-            N = other.N;
-//            material = other.material ? new Material( *(other.material) ) : 0;
-			if( other.material )
-            {
-                if( material )
-                    *material = *other.material;
-                else
-                    material = new Material(*other.material );
-            }
-            else
-            {
-                material = 0;
-            }
-        }
-        return *this;
-    }
+    void setBary( const vec3f& b ) { bary = b; }
+    void setFace( int f ) { face = f; }
 
 public:
     const SceneObject 	*obj;
     double t;
     vec3f N;
-    Material *material;         // if this intersection has its own material
-                                // (as opposed to one in its associated object)
-                                // as in the case where the material was interpolated
+    vec3f bary;                 // barycentric coordinates of the hit on
+                                // obj, for objects that interpolate
+                                // materials (trimeshes)
+    int face;                   // which face of obj was hit, for objects
+                                // made of many faces; -1 otherwise
 
-    const Material &getMaterial() const;
+    Material getMaterial() const;
     // Other info here.
 };
 
@@ -1,84 +1,97 @@
 #include <cmath>
+#include <float.h>
 
 #include "scene.h"
 #include "light.h"
+#include "../RenderStats.h"
 #include "../ui/TraceUI.h"
 extern TraceUI* traceUI;
 
-void BoundingBox::operator=(const BoundingBox& target)
+// Work out which kind of matrix xform is.  The linear part L is a scaled
+// rotation exactly when L^T L is a multiple of the identity.  The
+// matrices are single precision, so "exactly" means to within a few
+// float roundings.
+void TransformNode::classify()
 {
-	min = target.min;
-	max = target.max;
-}
+    const double eps = 8.0 * FLT_EPSILON;
 
-// Does this bounding box intersect the target?
-bool BoundingBox::intersects(const BoundingBox &target) const
-{
-	return ((target.min[0] - RAY_EPSILON <= max[0]) && (target.max[0] + RAY_EPSILON >= min[0]) &&
-			(target.min[1] - RAY_EPSILON <= max[1]) && (target.max[1] + RAY_EPSILON >= min[1]) &&
-			(target.min[2] - RAY_EPSILON <= max[2]) && (target.max[2] + RAY_EPSILON >= min[2]));
-}
+    linear = xform.upper33();
+    linearInverse = inverse.upper33();
+    translation = vec3f( xform[0][3], xform[1][3], xform[2][3] );
+    scale = 1.0;
+    kind = GENERAL;
 
-// does the box contain this point?
-bool BoundingBox::intersects(const vec3f& point) const
-{
-	return ((point[0] + RAY_EPSILON >= min[0]) && (point[1] + RAY_EPSILON >= min[1]) && (point[2] + RAY_EPSILON >= min[2]) &&
-		 (point[0] - RAY_EPSILON <= max[0]) && (point[1] - RAY_EPSILON <= max[1]) && (point[2] - RAY_EPSILON <= max[2]));
-}
+    if( fabs( xform[3][0] ) > eps || fabs( xform[3][1] ) > eps ||
+        fabs( xform[3][2] ) > eps || fabs( xform[3][3] - 1.0 ) > eps )
+        return;
 
-// if the ray hits the box, put the "t" value of the intersection
-// closest to the origin in tMin and the "t" value of the far intersection
-// in tMax and return true, else return false.
-// Using Kay/Kajiya algorithm.
-bool BoundingBox::intersect(const ray& r, double& tMin, double& tMax) const
-{
-	vec3f R0 = r.getPosition();
-	vec3f Rd = r.getDirection();
+    mat3f g = linear.transpose() * linear;
+    double s2 = g[0][0];
+    if( s2 <= 0.0 )
+        return;
 
-	tMin = -1.0e308; // 1.0e308 is close to infinity... close enough for us!
-	tMax = 1.0e308;
-	double ttemp;
-	
-	for (int currentaxis = 0; currentaxis < 3; currentaxis++)
-	{
-		double vd = Rd[currentaxis];
-		
-		// if the ray is parallel to the face's plane (=0.0)
-		if( vd == 0.0 )
-			continue;
+    for( int r = 0; r < 3; ++r )
+        for( int c = 0; c < 3; ++c )
+            if( fabs( g[r][c] - (r == c ? s2 : 0.0) ) > eps * s2 )
+                return;
 
-		double v1 = min[currentaxis] - R0[currentaxis];
-		double v2 = max[currentaxis] - R0[currentaxis];
-
-		// two slab intersections
-		double t1 = v1/vd;
-		double t2 = v2/vd;
-		
-		if ( t1 > t2 ) { // swap t1 & t2
-			ttemp = t1;
-			t1 = t2;
-			t2 = ttemp;
-		}
+    if( fabs( s2 - 1.0 ) > eps ) {
+        kind = UNIFORM_SCALE;
+        scale = sqrt( s2 );
+        return;
+    }
 
-		if (t1 > tMin)
-			tMin = t1;
-		if (t2 < tMax)
-			tMax = t2;
+    kind = RIGID;
+    for( int r = 0; r < 3; ++r )
+        for( int c = 0; c < 3; ++c )
+            if( fabs( linear[r][c] - (r == c ? 1.0 : 0.0) ) > eps )
+                return;
 
-		if (tMin > tMax) // box is missed
-			return false;
-		if (tMax < 0.0) // box is behind ray
-			return false;
-	}
-	return true; // it made it past all 3 axes.
+    kind = translation.iszero() ? IDENTITY : TRANSLATE;
 }
 
-
 bool Geometry::intersect(const ray&r, isect&i) const
 {
+    const vec3f& p = r.getPosition();
+    const vec3f& d = r.getDirection();
+
+    switch( transform->getKind() ) {
+    case TransformNode::IDENTITY:
+        // objects directly under the TransformRoot live in world space.
+        return intersectLocal( r, i );
+
+    case TransformNode::TRANSLATE:
+        // directions, normals and t are unaffected by a translation.
+        return intersectLocal( ray( p - transform->getTranslation(), d ), i );
+
+    case TransformNode::RIGID:
+        // the local direction is still unit length, so t is unchanged
+        // and normals only need rotating back.
+        if( !intersectLocal( ray( transform->globalToLocalCoords( p ),
+                                  transform->globalToLocalDirection( d ) ), i ) )
+            return false;
+        i.N = transform->localToGlobalDirection( i.N );
+        return true;
+
+    case TransformNode::UNIFORM_SCALE:
+    {
+        // a local unit step is 'scale' world units long.
+        double s = transform->getScale();
+        if( !intersectLocal( ray( transform->globalToLocalCoords( p ),
+                                  transform->globalToLocalDirection( d ) * s ), i ) )
+            return false;
+        i.N = transform->localToGlobalDirection( i.N ) / s;
+        i.t *= s;
+        return true;
+    }
+
+    default:
+        break;
+    }
+
     // Transform the ray into the object's local coordinate space
-    vec3f pos = transform->globalToLocalCoords(r.getPosition());
-    vec3f dir = transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
+    vec3f pos = transform->globalToLocalCoords( p );
+    vec3f dir = transform->globalToLocalDirection( d );
     double length = dir.length();
     dir /= length;
 
@@ -101,6 +114,47 @@ bool Geometry::intersectLocal( const ray& r, isect& i ) const
 	return false;
 }
 
+bool Geometry::occluded(const ray& r, double tMax) const
+{
+    const vec3f& p = r.getPosition();
+    const vec3f& d = r.getDirection();
+
+    // same cases as intersect(); only the scale of t needs following.
+    switch( transform->getKind() ) {
+    case TransformNode::IDENTITY:
+        return occludedLocal( r, tMax );
+
+    case TransformNode::TRANSLATE:
+        return occludedLocal( ray( p - transform->getTranslation(), d ), tMax );
+
+    case TransformNode::RIGID:
+        return occludedLocal( ray( transform->globalToLocalCoords( p ),
+                                   transform->globalToLocalDirection( d ) ), tMax );
+
+    case TransformNode::UNIFORM_SCALE:
+    {
+        double s = transform->getScale();
+        return occludedLocal( ray( transform->globalToLocalCoords( p ),
+                                   transform->globalToLocalDirection( d ) * s ), tMax / s );
+    }
+
+    default:
+        break;
+    }
+
+    vec3f dir = transform->globalToLocalDirection( d );
+    double length = dir.length();
+    dir /= length;
+
+    return occludedLocal( ray( transform->globalToLocalCoords( p ), dir ), tMax * length );
+}
+
+bool Geometry::occludedLocal( const ray& r, double tMax ) const
+{
+	isect i;
+	return intersectLocal( r, i ) && i.t < tMax;
+}
+
 bool Geometry::hasBoundingBoxCapability() const
 {
 	// by default, primitives do not have to specify a bounding box.
@@ -115,41 +169,109 @@ bool Geometry::hasBoundingBoxCapability() const
 	return false;
 }
 
+void Geometry::ComputeBoundingBox()
+{
+	bounds = transformBox( ComputeLocalBoundingBox() );
+}
+
+// Each world axis is an affine function of the local coordinates, so
+// over the box it ranges from the value at the center minus to plus
+// the sum of |coefficient| * half extent.
+BoundingBox Geometry::transformBox( const BoundingBox& local ) const
+{
+	vec3f center = transform->localToGlobalCoords( (local.min + local.max) * 0.5 );
+	vec3f half = (local.max - local.min) * 0.5;
+	const mat3f& l = transform->getLinear();
+
+	vec3f extent;
+	for( int axis = 0; axis < 3; ++axis )
+		extent[axis] = fabs( l[axis][0] ) * half[0] + fabs( l[axis][1] ) * half[1] +
+			fabs( l[axis][2] ) * half[2];
+
+	BoundingBox b;
+	b.min = center - extent;
+	b.max = center + extent;
+	return b;
+}
+
+// The disk is center + r (cos a * u + sin a * v) for the images u, v of
+// the local x and y axes; along a world axis that swings by |r| times the
+// length of (u[axis], v[axis]).
+BoundingBox Geometry::transformDisk( double z, double r ) const
+{
+	vec3f center = transform->localToGlobalCoords( vec3f( 0.0, 0.0, z ) );
+	const mat3f& l = transform->getLinear();
+
+	vec3f extent;
+	for( int axis = 0; axis < 3; ++axis )
+		extent[axis] = fabs( r ) * sqrt( l[axis][0] * l[axis][0] + l[axis][1] * l[axis][1] );
+
+	BoundingBox b;
+	b.min = center - extent;
+	b.max = center + extent;
+	return b;
+}
+
 Scene::~Scene()
 {
     giter g;
     liter l;
     
+	// objects owns every geometry; the other arrays only index into it
 	for( g = objects.begin(); g != objects.end(); ++g ) {
 		delete (*g);
 	}
 
-	for( g = boundedobjects.begin(); g != boundedobjects.end(); ++g ) {
-		delete (*g);
-	}
-
-	for( g = nonboundedobjects.begin(); g != boundedobjects.end(); ++g ) {
-		delete (*g);
-	}
-
 	for( l = lights.begin(); l != lights.end(); ++l ) {
 		delete (*l);
 	}
 }
 
+// Closest-hit visitor for the scene hierarchy: intersects one leaf entry
+// of the BVH and keeps the nearest hit found so far.
+struct SceneHitVisitor
+{
+	const vector<Geometry*>& objects;
+	const ray& r;
+	isect& i;
+	isect cur;
+
+	SceneHitVisitor( const vector<Geometry*>& o, const ray& rr, isect& ii )
+		: objects( o ), r( rr ), i( ii ) {}
+
+	bool operator()( int k, double& tMax )
+	{
+		STAT_ADD( objectTests, 1 );
+		if( !objects[k]->intersect( r, cur ) )
+			return false;
+		STAT_ADD( objectHits, 1 );
+		if( cur.t < tMax ) {
+			i = cur;
+			tMax = cur.t;
+			return true;
+		}
+		return false;
+	}
+};
+
 // Get any intersection with an object.  Return information about the 
 // intersection through the reference parameter.
 bool Scene::intersect( const ray& r, isect& i ) const
 {
-	typedef list<Geometry*>::const_iterator iter;
+	typedef vector<Geometry*>::const_iterator iter;
 	iter j;
 
 	isect cur;
 	bool have_one = false;
 
+	STAT_TIMER_FINE( TRAVERSE );
+	STAT_ADD( rays, 1 );
+	STAT_ADD( objectTests, nonboundedobjects.size() );
+
 	// try the non-bounded objects
 	for( j = nonboundedobjects.begin(); j != nonboundedobjects.end(); ++j ) {
 		if( (*j)->intersect( r, cur ) ) {
+			STAT_ADD( objectHits, 1 );
 			if( !have_one || (cur.t < i.t) ) {
 				i = cur;
 				have_one = true;
@@ -157,31 +279,141 @@ bool Scene::intersect( const ray& r, isect& i ) const
 		}
 	}
 
-	// try the bounded objects
-	for( j = boundedobjects.begin(); j != boundedobjects.end(); ++j ) {
-		if( (*j)->intersect( r, cur ) ) {
-			if( !have_one || (cur.t < i.t) ) {
-				i = cur;
-				have_one = true;
+	// walk the hierarchy over the bounded objects, only accepting hits
+	// closer than what the non-bounded objects already gave us.
+	SceneHitVisitor visit( bvhobjects, r, i );
+	if( bvh.traverse( r, have_one ? i.t : 1.0e308, visit ) )
+		have_one = true;
+
+	STAT_ADD( hits, have_one );
+	return have_one;
+}
+
+// Any-hit visitor for the scene hierarchy.
+struct SceneOcclusionVisitor
+{
+	const vector<Geometry*>& objects;
+	const ray& r;
+
+	SceneOcclusionVisitor( const vector<Geometry*>& o, const ray& rr )
+		: objects( o ), r( rr ) {}
+
+	bool operator()( int k, double& tMax )
+	{
+		STAT_ADD( objectTests, 1 );
+		bool blocked = objects[k]->occluded( r, tMax );
+		STAT_ADD( objectHits, blocked );
+		return blocked;
+	}
+};
+
+bool Scene::occluded( const ray& r, double tMax ) const
+{
+	typedef vector<Geometry*>::const_iterator iter;
+
+	STAT_TIMER_FINE( TRAVERSE );
+	STAT_ADD( rays, 1 );
+	STAT_RAY( SHADOW );
+
+	for( iter j = nonboundedobjects.begin(); j != nonboundedobjects.end(); ++j ) {
+		STAT_ADD( objectTests, 1 );
+		if( (*j)->occluded( r, tMax ) ) {
+			STAT_ADD( objectHits, 1 );
+			STAT_ADD( hits, 1 );
+			return true;
+		}
+	}
+
+	SceneOcclusionVisitor visit( bvhobjects, r );
+	bool blocked = bvh.traverseAny( r, tMax, visit );
+	STAT_ADD( hits, blocked );
+	return blocked;
+}
+
+// Closest-hit visitor for packets: like SceneHitVisitor, for the ray of
+// the packet the BVH asks about.
+struct ScenePacketVisitor
+{
+	const vector<Geometry*>& objects;
+	const ray *rays;
+	isect *hits;
+	isect cur;
+
+	ScenePacketVisitor( const vector<Geometry*>& o, const ray *rr, isect *ii )
+		: objects( o ), rays( rr ), hits( ii ) {}
+
+	bool operator()( int lane, int first, int count, double& tMax )
+	{
+		bool hit = false;
+		STAT_ADD( objectTests, count );
+		for( int k = first; k < first + count; ++k ) {
+			if( !objects[k]->intersect( rays[lane], cur ) )
+				continue;
+			STAT_ADD( objectHits, 1 );
+			if( cur.t < tMax ) {
+				hits[lane] = cur;
+				tMax = cur.t;
+				hit = true;
 			}
 		}
+		return hit;
 	}
+};
 
+int Scene::intersectPacket( const ray *r, isect *i, int mask ) const
+{
+	typedef vector<Geometry*>::const_iterator iter;
 
-	return have_one;
+	double tMax[ BVH::PACKET_SIZE ];
+	int hit = 0;
+	isect cur;
+
+	STAT_TIMER_FINE( TRAVERSE );
+
+	// the non-bounded objects, one ray at a time
+	for( int lane = 0; lane < BVH::PACKET_SIZE; ++lane ) {
+		tMax[lane] = 1.0e308;
+		if( !(mask & (1 << lane)) )
+			continue;
+
+		STAT_ADD( rays, 1 );
+		STAT_ADD( objectTests, nonboundedobjects.size() );
+		for( iter j = nonboundedobjects.begin(); j != nonboundedobjects.end(); ++j ) {
+			if( !(*j)->intersect( r[lane], cur ) )
+				continue;
+			STAT_ADD( objectHits, 1 );
+			if( cur.t < tMax[lane] ) {
+				i[lane] = cur;
+				tMax[lane] = cur.t;
+				hit |= 1 << lane;
+			}
+		}
+	}
+
+	ScenePacketVisitor visit( bvhobjects, r, i );
+	hit |= bvh.traversePacket( r, tMax, mask, visit );
+
+	STAT_ADD( hits, (hit & 1) + ((hit >> 1) & 1) + ((hit >> 2) & 1) + ((hit >> 3) & 1) );
+	return hit;
 }
 
 void Scene::initScene()
 {
+	if( initialized )
+		return;
+
+	STAT_TIMER( INIT );
 	bool first_boundedobject = true;
 	BoundingBox b;
 	
-	typedef list<Geometry*>::const_iterator iter;
+	typedef vector<Geometry*>::const_iterator iter;
+	vector<Geometry*> bounded;
+
 	// split the objects into two categories: bounded and non-bounded
 	for( iter j = objects.begin(); j != objects.end(); ++j ) {
 		if( (*j)->hasBoundingBoxCapability() )
 		{
-			boundedobjects.push_back(*j);
+			bounded.push_back(*j);
 
 			// widen the scene's bounding box, if necessary
 			if (first_boundedobject) {
@@ -198,4 +430,23 @@ void Scene::initScene()
 		else
 			nonboundedobjects.push_back(*j);
 	}
+
+	// build the hierarchy over the bounded objects
+	vector<BoundingBox> boxes;
+	for( int k = 0; k < (int)bounded.size(); ++k )
+		boxes.push_back( bounded[k]->getBoundingBox() );
+
+	vector<int> order;
+	bvh.build( boxes, order );
+
+	bvhobjects.resize( order.size() );
+	for( int k = 0; k < (int)order.size(); ++k )
+		bvhobjects[k] = bounded[ order[k] ];
+
+	// the scene is complete now; drop the slack left by push_back
+	vector<Geometry*>( objects ).swap( objects );
+	vector<Geometry*>( nonboundedobjects ).swap( nonboundedobjects );
+	vector<Light*>( lights ).swap( lights );
+
+	initialized = true;
 }
@@ -8,6 +8,7 @@
 #define __SCENE_H__
 
 #include <list>
+#include <vector>
 #include <algorithm>
 
 using namespace std;
@@ -15,10 +16,12 @@ using namespace std;
 #include "ray.h"
 #include "material.h"
 #include "camera.h"
+#include "bvh.h"
 #include "../vecmath/vecmath.h"
 
 class Light;
 class Scene;
+class SceneCache;
 
 class SceneElement
 {
@@ -34,28 +37,20 @@ protected:
     Scene *scene;
 };
 
-class BoundingBox
+class TransformNode
 {
 public:
-	vec3f min;
-	vec3f max;
-
-	void operator=(const BoundingBox& target);
-
-	// Does this bounding box intersect the target?
-	bool intersects(const BoundingBox &target) const;
-	
-	// does the box contain this point?
-	bool intersects(const vec3f& point) const;
-
-	// if the ray hits the box, put the "t" value of the intersection
-	// closest to the origin in tMin and the "t" value of the far intersection
-	// in tMax and return true, else return false.
-	bool intersect(const ray& r, double& tMin, double& tMax) const;
-};
+    // What kind of matrix xform turned out to be.  Geometry::intersect
+    // uses this to pick the cheapest path that is still exact.
+    enum Kind
+    {
+        IDENTITY,           // no transformation at all
+        TRANSLATE,          // translation only
+        RIGID,              // rotation (or reflection) and translation
+        UNIFORM_SCALE,      // rigid motion combined with a uniform scale
+        GENERAL             // non-uniform scale, shear, ...
+    };
 
-class TransformNode
-{
 protected:
 
     // information about this node's transformation
@@ -63,9 +58,18 @@ protected:
 	mat4f    inverse;
 	mat3f    normi;
 
+    // cached pieces of xform for the cheap paths
+    Kind     kind;
+    double   scale;         // uniform scale factor, 1 unless UNIFORM_SCALE
+    mat3f    linear;        // upper 3x3 of xform
+    mat3f    linearInverse; // upper 3x3 of inverse
+    vec3f    translation;   // translation part of xform
+
     // information about parent & children
     TransformNode *parent;
     list<TransformNode*> children;
+
+    friend class SceneCache;
     
 public:
    	typedef list<TransformNode*>::iterator          child_iter;
@@ -83,6 +87,11 @@ public:
         children.push_back(child);
         return child;
     }
+
+    Kind getKind() const { return kind; }
+    double getScale() const { return scale; }
+    const vec3f& getTranslation() const { return translation; }
+    const mat3f& getLinear() const { return linear; }
     
     // Coordinate-Space transformation
     vec3f globalToLocalCoords(const vec3f &v)
@@ -105,6 +114,17 @@ public:
         return (normi * v).normalize();
     }
 
+    // Directions only go through the linear part; no translation.
+    vec3f globalToLocalDirection(const vec3f &v) const
+    {
+        return linearInverse * v;
+    }
+
+    vec3f localToGlobalDirection(const vec3f &v) const
+    {
+        return linear * v;
+    }
+
 protected:
     // protected so that users can't directly construct one of these...
     // force them to use the createChild() method.  Note that they CAN
@@ -120,7 +140,11 @@ protected:
         
         inverse = this->xform.inverse();
         normi = this->xform.upper33().inverse().transpose();
+
+        classify();
     }
+
+    void classify();
 };
 
 class TransformRoot : public TransformNode
@@ -144,49 +168,21 @@ public:
     // do not call directly - this should only be called by intersect()
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
 
+    // does the object block the ray somewhere before tMax?  Like
+    // intersect(), this works in global space and hands a local ray
+    // (with tMax in local units) to occludedLocal(), which by default
+    // just asks intersectLocal() for the closest hit.
+    bool occluded(const ray& r, double tMax) const;
+    virtual bool occludedLocal( const ray& r, double tMax ) const;
+
 
 	virtual bool hasBoundingBoxCapability() const;
 	const BoundingBox& getBoundingBox() const { return bounds; }
-	virtual void ComputeBoundingBox()
-    {
-        // take the object's local bounding box, transform all 8 points on it,
-        // and use those to find a new bounding box.
-
-        BoundingBox localBounds = ComputeLocalBoundingBox();
-        
-        vec3f min = localBounds.min;
-		vec3f max = localBounds.max;
-
-		vec4f v, newMax, newMin;
-
-		v = transform->localToGlobalCoords( vec4f(min[0], min[1], min[2], 1) );
-		newMax = v;
-		newMin = v;
-		v = transform->localToGlobalCoords( vec4f(max[0], min[1], min[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( vec4f(min[0], max[1], min[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( vec4f(max[0], max[1], min[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( vec4f(min[0], min[1], max[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( vec4f(max[0], min[1], max[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( vec4f(min[0], max[1], max[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( vec4f(max[0], max[1], max[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		
-		bounds.max = vec3f(newMax);
-		bounds.min = vec3f(newMin);
-    }
+	// Work out the world space bounds.  By default this is the local
+	// bounding box put through the transform, which is exact for boxes
+	// but loose for anything round that has been rotated; objects that
+	// can do better override it.
+	virtual void ComputeBoundingBox();
 
     // default method for ComputeLocalBoundingBox returns a bogus bounding box;
     // this should be overridden if hasBoundingBoxCapability() is true.
@@ -198,8 +194,19 @@ public:
 		: SceneElement( scene ) {}
 
 protected:
+	// The world bounds of the local box: exactly the box around its 8
+	// transformed corners.
+	BoundingBox transformBox( const BoundingBox& local ) const;
+
+	// The world bounds of the disk of radius r around the local z axis,
+	// at height z.  A cylinder or cone is exactly bounded by its two end
+	// disks.
+	BoundingBox transformDisk( double z, double r ) const;
+
 	BoundingBox bounds;
     TransformNode *transform;
+
+	friend class SceneCache;
 };
 
 // A SceneObject is a real actual thing that we want to model in the 
@@ -213,6 +220,11 @@ public:
 	virtual const Material& getMaterial() const = 0;
 	virtual void setMaterial( Material *m ) = 0;
 
+	// The material at a particular hit on this object.  Objects whose
+	// material varies over the surface override this and interpolate
+	// using the hit information (e.g. i.bary).
+	virtual Material getMaterial( const isect& i ) const { return getMaterial(); }
+
 protected:
 	SceneObject( Scene *scene )
 		: Geometry( scene ) {}
@@ -226,6 +238,7 @@ class MaterialSceneObject
 public:
 	virtual ~MaterialSceneObject() { if( material ) delete material; }
 
+	using SceneObject::getMaterial;
 	virtual const Material& getMaterial() const { return *material; }
 	virtual void setMaterial( Material *m )	{ material = m; }
 
@@ -241,17 +254,17 @@ protected:
 class Scene
 {
 public:
-	typedef list<Light*>::iterator 			liter;
-	typedef list<Light*>::const_iterator 	cliter;
+	typedef vector<Light*>::iterator 			liter;
+	typedef vector<Light*>::const_iterator 	cliter;
 
-	typedef list<Geometry*>::iterator 		giter;
-	typedef list<Geometry*>::const_iterator cgiter;
+	typedef vector<Geometry*>::iterator 		giter;
+	typedef vector<Geometry*>::const_iterator cgiter;
 
     TransformRoot transformRoot;
 
 public:
 	Scene() 
-		: transformRoot(), objects(), lights() {}
+		: transformRoot(), objects(), lights(), initialized( false ) {}
 	virtual ~Scene();
 
 	void add( Geometry* obj )
@@ -263,26 +276,51 @@ public:
 	{ lights.push_back( light ); }
 
 	bool intersect( const ray& r, isect& i ) const;
+
+	// Is anything in the way of r before tMax?  Stops at the first
+	// blocker found rather than looking for the closest hit; meant for
+	// shadow rays.
+	bool occluded( const ray& r, double tMax ) const;
+
+	// Intersect the rays r[lane] whose bit is set in mask (up to
+	// BVH::PACKET_SIZE of them) together, sharing the walk through the
+	// hierarchy.  Returns the mask of rays that hit, with hits in i[lane].
+	int intersectPacket( const ray *r, isect *i, int mask ) const;
+
+	// Build the hierarchy over the objects; call once every object has
+	// been added.  A scene loaded from a SceneCache comes initialized,
+	// and calling this again does nothing.
 	void initScene();
 
-	list<Light*>::const_iterator beginLights() const { return lights.begin(); }
-	list<Light*>::const_iterator endLights() const { return lights.end(); }
+	cliter beginLights() const { return lights.begin(); }
+	cliter endLights() const { return lights.end(); }
+	int numLights() const { return (int)lights.size(); }
+	Light *getLight( int k ) const { return lights[k]; }
         
 	Camera *getCamera() { return &camera; }
 
 	
 
 private:
-    list<Geometry*> objects;
-	list<Geometry*> nonboundedobjects;
-	list<Geometry*> boundedobjects;
-    list<Light*> lights;
+	// Plain arrays, so the loops over them in intersect() and in the
+	// shading code walk contiguous memory.  objects owns the geometry;
+	// initScene() splits it into nonboundedobjects and bvhobjects (the
+	// bounded objects, in the leaf order of bvh).
+    vector<Geometry*> objects;
+	vector<Geometry*> nonboundedobjects;
+    vector<Light*> lights;
+	vector<Geometry*> bvhobjects;
+	BVH bvh;
     Camera camera;
 	
 	// Each object in the scene, provided that it has hasBoundingBoxCapability(),
 	// must fall within this bounding box.  Objects that don't have hasBoundingBoxCapability()
 	// are exempt from this requirement.
 	BoundingBox sceneBounds;
+
+	bool initialized;
+
+	friend class SceneCache;
 };
 
 #endif // __SCENE_H__
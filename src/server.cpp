@@ -0,0 +1,502 @@
+// rayd: a headless render daemon.  It watches a spool directory for job
+// files and renders them, keeping parsed and initialized scenes cached
+// between jobs, and running several jobs at once on one shared pool of
+// render threads.
+//
+// usage: rayd [-p threads] [-j jobs] [-c scenes] [-i ms] spooldir
+//
+// A job is a text file named <name>.job with one "key = value" per line:
+//
+//   scene = scenes/city.ray         (required)
+//   output = frames/city_0001.png   (required; .bmp, .ppm, .png or .hdr)
+//   width = 640                     (default 512)
+//   height = 480                    (default: from the aspect ratio)
+//   depth = 3                       (recursion depth, default 0)
+//   cutoff = 0.001                  (rays weighted below it are not traced;
+//                                   default 1/4096, 0 = all)
+//   roulette = 1                    (Russian roulette below the cutoff)
+//   antialias = 2                   (adaptive anti-aliasing levels, default 0)
+//   compression = 9                 (PNG compression level 0-9, default 6)
+//   exposure = 1.5                  (in stops, for the 8 bit formats; default 0)
+//   tonemap = reinhard              (clamp, the default, or reinhard)
+//   position = (0, 2, -8)           camera overrides; any subset
+//   viewdir = (0, 0, 1)             (viewdir needs updir and vice versa)
+//   updir = (0, 1, 0)
+//   fov = 45
+//   aspectratio = 1.333
+//   frames = 120                    a turntable: the camera circles center
+//   orbit = 360                     and looks at it, turning orbit degrees
+//   center = (0, 0, 0)              (default 360) about updir (default
+//                                   (0, 1, 0)) over the frames; output then
+//                                   needs a %d, e.g. frames/spin_%04d.png
+//
+// The frames of a sequence are rendered one after another by the same
+// RayTracer, only moving its camera, so the scene is built once for the
+// whole sequence.
+//
+// The daemon claims a job by renaming it to <name>.working, and when the
+// job is finished renames it to <name>.done, or to <name>.failed with an
+// "error = ..." line appended.  Relative paths are taken relative to the
+// daemon's working directory.  Creating a file named "stop" in the spool
+// directory shuts the daemon down once the running jobs are done.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "RayTracer.h"
+#include "ThreadPool.h"
+#include "fileio/read.h"
+#include "fileio/imagewriter.h"
+
+extern int getopt(int argc, char **argv, char *optstring);
+extern char* optarg;
+extern int optind;
+
+using namespace std;
+namespace fs = std::filesystem;
+
+static int g_threads = 0;
+static int g_jobs = 2;
+static int g_cacheSize = 8;
+static int g_pollMs = 200;
+
+// Scenes are cached by path and reloaded when the file changes.  A job
+// holds a shared_ptr to its scene, so a scene that is reloaded or evicted
+// while jobs still render it lives until the last of them is done.
+//
+// The lock only covers the map.  The job that misses puts a pending
+// entry in and loads the scene outside the lock; jobs that want the same
+// scene meanwhile wait on the entry's future, and jobs that want other
+// scenes are not held up at all.
+//
+// (This is the daemon's in-memory cache; SceneCache, in fileio, is the
+// binary cache file next to a .ray file.)
+class SceneStore
+{
+public:
+	shared_ptr<Scene> get( const string& path, string& error );
+
+private:
+	typedef shared_future< shared_ptr<Scene> > Loading;
+
+	struct Entry
+	{
+		Loading scene;
+		fs::file_time_type mtime;
+		long long lastUse;
+		long long load;				// which load made the entry
+	};
+
+	mutex lock;
+	map<string, Entry> entries;
+	long long useCount = 0;
+	long long loadCount = 0;
+};
+
+shared_ptr<Scene> SceneStore::get( const string& path, string& error )
+{
+	error_code ec;
+	fs::file_time_type mtime = fs::last_write_time( path, ec );
+	if( ec ) {
+		error = "can't read scene file " + path;
+		return shared_ptr<Scene>();
+	}
+
+	promise< shared_ptr<Scene> > loaded;
+	Loading scene;
+	long long load = 0;
+	{
+		lock_guard<mutex> guard( lock );
+
+		map<string, Entry>::iterator it = entries.find( path );
+		if( it != entries.end() && it->second.mtime == mtime ) {
+			it->second.lastUse = ++useCount;
+			scene = it->second.scene;
+		} else {
+			Entry& entry = entries[ path ];
+			entry.scene = scene = loaded.get_future().share();
+			entry.mtime = mtime;
+			entry.lastUse = ++useCount;
+			entry.load = load = ++loadCount;
+
+			// evict the least recently used scenes; the new entry is
+			// the most recently used, so it stays
+			while( (int)entries.size() > g_cacheSize ) {
+				map<string, Entry>::iterator oldest = entries.begin();
+				for( it = entries.begin(); it != entries.end(); ++it ) {
+					if( it->second.lastUse < oldest->second.lastUse )
+						oldest = it;
+				}
+				entries.erase( oldest );
+			}
+		}
+	}
+
+	if( load ) {
+		Scene *s = readScene( path );
+		if( s )
+			s->initScene();
+		loaded.set_value( shared_ptr<Scene>( s ) );
+
+		// don't keep a failure; the next job tries again
+		if( !s ) {
+			lock_guard<mutex> guard( lock );
+			map<string, Entry>::iterator it = entries.find( path );
+			if( it != entries.end() && it->second.load == load )
+				entries.erase( it );
+		}
+	}
+
+	shared_ptr<Scene> result = scene.get();
+	if( !result )
+		error = "can't parse scene file " + path;
+	return result;
+}
+
+struct Job
+{
+	map<string, string> fields;
+
+	bool has( const string& key ) const { return fields.count( key ) > 0; }
+	string get( const string& key ) const
+	{
+		map<string, string>::const_iterator it = fields.find( key );
+		return it == fields.end() ? string() : it->second;
+	}
+};
+
+static string trim( const string& s )
+{
+	size_t a = s.find_first_not_of( " \t\r" );
+	size_t b = s.find_last_not_of( " \t\r" );
+	return a == string::npos ? string() : s.substr( a, b - a + 1 );
+}
+
+static bool readJob( const string& path, Job& job )
+{
+	ifstream is( path.c_str() );
+	if( !is )
+		return false;
+
+	string line;
+	while( getline( is, line ) ) {
+		size_t eq = line.find( '=' );
+		if( eq == string::npos || trim( line ).empty() || trim( line )[0] == '#' )
+			continue;
+		job.fields[ trim( line.substr( 0, eq ) ) ] = trim( line.substr( eq + 1 ) );
+	}
+	return true;
+}
+
+// "(x, y, z)" or "x y z"
+static bool parseVec( const string& s, vec3f& v )
+{
+	string t = s;
+	replace( t.begin(), t.end(), ',', ' ' );
+	replace( t.begin(), t.end(), '(', ' ' );
+	replace( t.begin(), t.end(), ')', ' ' );
+	istringstream is( t );
+	return (bool)(is >> v[0] >> v[1] >> v[2]);
+}
+
+static bool parseNumber( const string& s, double& d )
+{
+	istringstream is( s );
+	return (bool)(is >> d);
+}
+
+// The name of frame k of a sequence: pattern has exactly one %d
+// conversion (with an optional width, like %04d) and no others.
+static bool frameName( const string& pattern, int k, string& name )
+{
+	size_t pct = pattern.find( '%' );
+	if( pct == string::npos )
+		return false;
+	size_t d = pattern.find_first_not_of( "0123456789", pct + 1 );
+	if( d == string::npos || pattern[d] != 'd' || pattern.find( '%', d ) != string::npos )
+		return false;
+
+	char buf[1024];
+	if( snprintf( buf, sizeof( buf ), pattern.c_str(), k ) >= (int)sizeof( buf ) )
+		return false;
+	name = buf;
+	return true;
+}
+
+// Render the image from the tracer's camera to output, writing it out
+// as the tiles finish.
+static bool renderFrame( RayTracer& tracer, ThreadPool& pool, const string& output,
+	int width, int height, int compression, string& error )
+{
+	ImageWriter *out = ImageWriter::create( output );
+	if( compression >= 0 )
+		out->setCompression( compression );
+	if( !out->open( output, width, height ) ) {
+		delete out;
+		error = "can't write " + output;
+		return false;
+	}
+
+	tracer.traceSetup( width, height );
+	tracer.traceTiles( pool.size(), 32, out );
+
+	bool ok = out->close();
+	delete out;
+	if( !ok ) {
+		error = "can't write " + output;
+		return false;
+	}
+	return true;
+}
+
+static bool runJob( SceneStore& cache, ThreadPool& pool, const Job& job, string& error )
+{
+	string scenePath = job.get( "scene" );
+	string output = job.get( "output" );
+	if( scenePath.empty() || output.empty() ) {
+		error = "a job needs a scene and an output";
+		return false;
+	}
+
+	shared_ptr<Scene> scene = cache.get( scenePath, error );
+	if( !scene )
+		return false;
+
+	RayTracer tracer;
+	tracer.setScene( scene.get() );
+	tracer.setThreadPool( &pool );
+
+	Camera *camera = tracer.getCamera();
+	vec3f v, up;
+	double d;
+
+	if( job.has( "position" ) ) {
+		if( !parseVec( job.get( "position" ), v ) ) {
+			error = "bad position";
+			return false;
+		}
+		camera->setEye( v );
+	}
+	if( job.has( "viewdir" ) || job.has( "updir" ) ) {
+		if( !parseVec( job.get( "viewdir" ), v ) || !parseVec( job.get( "updir" ), up ) ) {
+			error = "viewdir and updir must be given together";
+			return false;
+		}
+		camera->setLook( v.normalize(), up.normalize() );
+	}
+	if( job.has( "fov" ) ) {
+		if( !parseNumber( job.get( "fov" ), d ) ) {
+			error = "bad fov";
+			return false;
+		}
+		camera->setFOV( d );
+	}
+
+	int width = job.has( "width" ) ? atoi( job.get( "width" ).c_str() ) : 512;
+	int height = job.has( "height" ) ? atoi( job.get( "height" ).c_str() ) : 0;
+	if( job.has( "aspectratio" ) ) {
+		if( !parseNumber( job.get( "aspectratio" ), d ) || d <= 0.0 ) {
+			error = "bad aspectratio";
+			return false;
+		}
+		camera->setAspectRatio( d );
+	} else if( height > 0 && width > 0 ) {
+		camera->setAspectRatio( double( width ) / height );
+	}
+	if( height <= 0 )
+		height = (int)(width / tracer.aspectRatio() + 0.5);
+	if( width <= 0 || height <= 0 ) {
+		error = "bad image size";
+		return false;
+	}
+
+	if( job.has( "depth" ) )
+		tracer.setDepth( atoi( job.get( "depth" ).c_str() ) );
+	if( job.has( "cutoff" ) ) {
+		if( !parseNumber( job.get( "cutoff" ), d ) || d < 0.0 ) {
+			error = "bad cutoff";
+			return false;
+		}
+		tracer.setCutoff( d );
+	}
+	if( job.has( "roulette" ) )
+		tracer.setRussianRoulette( atoi( job.get( "roulette" ).c_str() ) != 0 );
+	if( job.has( "antialias" ) )
+		tracer.setAntialias( atoi( job.get( "antialias" ).c_str() ) );
+
+	ToneMap tm;
+	if( job.has( "exposure" ) && !parseNumber( job.get( "exposure" ), tm.exposure ) ) {
+		error = "bad exposure";
+		return false;
+	}
+	if( job.has( "tonemap" ) ) {
+		string curve = job.get( "tonemap" );
+		if( curve == "reinhard" )
+			tm.curve = ToneMap::REINHARD;
+		else if( curve != "clamp" ) {
+			error = "bad tonemap";
+			return false;
+		}
+	}
+
+	tracer.setToneMap( tm );
+	int compression = job.has( "compression" ) ? atoi( job.get( "compression" ).c_str() ) : -1;
+
+	if( !job.has( "frames" ) )
+		return renderFrame( tracer, pool, output, width, height, compression, error );
+
+	int frames = atoi( job.get( "frames" ).c_str() );
+	double orbit = 360.0;
+	vec3f center( 0.0, 0.0, 0.0 );
+	up = job.has( "updir" ) ? up.normalize() : vec3f( 0.0, 1.0, 0.0 );
+	string name;
+	if( frames <= 0 ) {
+		error = "bad frames";
+		return false;
+	}
+	if( job.has( "orbit" ) && !parseNumber( job.get( "orbit" ), orbit ) ) {
+		error = "bad orbit";
+		return false;
+	}
+	if( job.has( "center" ) && !parseVec( job.get( "center" ), center ) ) {
+		error = "bad center";
+		return false;
+	}
+	if( !frameName( output, 0, name ) ) {
+		error = "the output of a sequence needs one %d for the frame number";
+		return false;
+	}
+
+	vec3f offset = camera->getEye() - center;
+	for( int k = 0; k < frames; ++k ) {
+		double angle = orbit * k / frames * 3.14159265358979 / 180.0;
+		vec3f eye = center + mat4f::rotate( up, angle ) * offset;
+		camera->setEye( eye );
+		camera->setLook( (center - eye).normalize(), up );
+
+		frameName( output, k, name );
+		if( !renderFrame( tracer, pool, name, width, height, compression, error ) )
+			return false;
+	}
+	return true;
+}
+
+// Claim the next job in the spool directory, if there is one.  Renaming
+// is atomic, so when several workers (or daemons) race for a job only
+// one of them gets it.
+static bool claimJob( const fs::path& spool, fs::path& claimed )
+{
+	error_code ec;
+	vector<fs::path> jobs;
+	for( fs::directory_iterator it( spool, ec ), end; !ec && it != end; ++it ) {
+		if( it->path().extension() == ".job" )
+			jobs.push_back( it->path() );
+	}
+	sort( jobs.begin(), jobs.end() );
+
+	for( int k = 0; k < (int)jobs.size(); ++k ) {
+		fs::path working = jobs[k];
+		working.replace_extension( ".working" );
+		fs::rename( jobs[k], working, ec );
+		if( !ec ) {
+			claimed = working;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void worker( const fs::path& spool, SceneStore& cache, ThreadPool& pool )
+{
+	error_code ec;
+	while( !fs::exists( spool / "stop", ec ) ) {
+		fs::path working;
+		if( !claimJob( spool, working ) ) {
+			this_thread::sleep_for( chrono::milliseconds( g_pollMs ) );
+			continue;
+		}
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		Job job;
+		string error;
+		bool ok = readJob( working.string(), job ) &&
+			runJob( cache, pool, job, error );
+		if( !ok && error.empty() )
+			error = "can't read job file";
+		double seconds = chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+
+		fs::path result = working;
+		if( ok ) {
+			result.replace_extension( ".done" );
+			printf( "%s: done in %.3f seconds\n", working.stem().string().c_str(), seconds );
+		} else {
+			result.replace_extension( ".failed" );
+			ofstream os( working.string().c_str(), ios::app );
+			os << "error = " << error << "\n";
+			fprintf( stderr, "%s: %s\n", working.stem().string().c_str(), error.c_str() );
+		}
+		fflush( stdout );
+		fs::rename( working, result, ec );
+	}
+}
+
+static void usage( const char *progname )
+{
+	fprintf( stderr, "usage: %s [options] spooldir\n", progname );
+	fprintf( stderr, "  -p <#>      render threads, 0 = all cores (default %d)\n", g_threads );
+	fprintf( stderr, "  -j <#>      jobs rendered at once (default %d)\n", g_jobs );
+	fprintf( stderr, "  -c <#>      scenes kept in the cache (default %d)\n", g_cacheSize );
+	fprintf( stderr, "  -i <#>      spool directory poll interval in ms (default %d)\n", g_pollMs );
+}
+
+int main( int argc, char **argv )
+{
+	int i;
+	while( (i = getopt( argc, argv, (char*)"p:j:c:i:" )) != EOF ) {
+		switch( i ) {
+		case 'p': g_threads = atoi( optarg ); break;
+		case 'j': g_jobs = max( 1, atoi( optarg ) ); break;
+		case 'c': g_cacheSize = max( 1, atoi( optarg ) ); break;
+		case 'i': g_pollMs = max( 1, atoi( optarg ) ); break;
+		default:
+			usage( argv[0] );
+			return 1;
+		}
+	}
+	if( optind >= argc ) {
+		usage( argv[0] );
+		return 1;
+	}
+
+	fs::path spool( argv[optind] );
+	if( !fs::is_directory( spool ) ) {
+		fprintf( stderr, "%s is not a directory\n", argv[optind] );
+		return 1;
+	}
+
+	// every job's tiles go through the same pool; ThreadPool::parallelFor
+	// lets the workers' batches share it.
+	ThreadPool pool( g_threads );
+	SceneStore cache;
+
+	vector<thread> workers;
+	for( int k = 0; k < g_jobs; ++k )
+		workers.push_back( thread( worker, spool, ref( cache ), ref( pool ) ) );
+	for( int k = 0; k < (int)workers.size(); ++k )
+		workers[k].join();
+
+	return 0;
+}
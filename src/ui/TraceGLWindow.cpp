@@ -2,10 +2,12 @@
 // A subclass of FL_GL_Window that handles drawing the traced image to the screen
 // 
 
+#include <FL/fl_ask.h>
+
 #include "TraceGLWindow.h"
 #include "../RayTracer.h"
 
-#include "../fileio/bitmap.h"
+#include "../fileio/imagewriter.h"
 
 TraceGLWindow::TraceGLWindow(int x, int y, int w, int h, const char *l)
 			: Fl_Gl_Window(x,y,w,h,l)
@@ -37,16 +39,17 @@ void TraceGLWindow::draw()
 
 	glClear( GL_COLOR_BUFFER_BIT );
 
-	unsigned char* buf;
-	raytracer->getBuffer(buf, m_nDrawWidth, m_nDrawHeight);
+	// a progressive render may still be writing the tracer's buffer,
+	// so draw a copy of its finished tiles
+	raytracer->copyBuffer(m_image, m_nDrawWidth, m_nDrawHeight);
 
-	if ( buf ) {
+	if ( !m_image.empty() ) {
 		// just copy image to GLwindow conceptually
 		glRasterPos2i( 0, 0 );
 		glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
 		glPixelStorei( GL_UNPACK_ROW_LENGTH, m_nDrawWidth );
 		glDrawBuffer( GL_BACK );
-		glDrawPixels( m_nDrawWidth, m_nDrawHeight, GL_RGB, GL_UNSIGNED_BYTE, buf );
+		glDrawPixels( m_nDrawWidth, m_nDrawHeight, GL_RGB, GL_UNSIGNED_BYTE, &m_image[0] );
 	}
 		
 	glFlush();
@@ -66,11 +69,16 @@ void TraceGLWindow::resizeWindow(int width, int height)
 
 void TraceGLWindow::saveImage(char *iname)
 {
-	unsigned char* buf;
-
-	raytracer->getBuffer(buf, m_nDrawWidth, m_nDrawHeight);
-	if (buf)
-		writeBMP(iname, m_nDrawWidth, m_nDrawHeight, buf); 
+	float* rad = NULL;
+
+	// the radiance is only complete once a progressive render is done;
+	// until then a floating point file gets the 8 bit pixels
+	raytracer->copyBuffer(m_image, m_nDrawWidth, m_nDrawHeight);
+	if (raytracer->progressiveDone())
+		raytracer->getRadiance(rad, m_nDrawWidth, m_nDrawHeight);
+	// the format follows the extension of iname
+	if (!m_image.empty() && !writeImage(iname, m_nDrawWidth, m_nDrawHeight, &m_image[0], 6, rad))
+		fl_alert("Can't write %s", iname);
 }
 
 void TraceGLWindow::setRayTracer(RayTracer *tracer)
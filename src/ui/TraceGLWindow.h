@@ -36,6 +36,7 @@ public:
 private:
 	int m_nWindowWidth, m_nWindowHeight;
 	int m_nDrawWidth, m_nDrawHeight;
+	vector<unsigned char> m_image;	// what is drawn; see draw()
 };
 
 #endif // __TRACE_GL_WINDOW_H__
\ No newline at end of file
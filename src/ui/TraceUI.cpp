@@ -45,7 +45,7 @@ void TraceUI::cb_save_image(Fl_Menu_* o, void* v)
 {
 	TraceUI* pUI=whoami(o);
 	
-	char* savefile = fl_file_chooser("Save Image?", "*.bmp", "save.bmp" );
+	char* savefile = fl_file_chooser("Save Image?", "*.{bmp,ppm,png,hdr}", "save.bmp" );
 	if (savefile != NULL) {
 		pUI->m_traceGlWindow->saveImage(savefile);
 	}
@@ -92,6 +92,32 @@ void TraceUI::cb_depthSlides(Fl_Widget* o, void* v)
 	((TraceUI*)(o->user_data()))->m_nDepth=int( ((Fl_Slider *)o)->value() ) ;
 }
 
+void TraceUI::cb_aaSlides(Fl_Widget* o, void* v)
+{
+	((TraceUI*)(o->user_data()))->m_nAntialias=int( ((Fl_Slider *)o)->value() ) ;
+}
+
+void TraceUI::cb_progressive(Fl_Widget* o, void* v)
+{
+	((TraceUI*)(o->user_data()))->m_bProgressive = ( ((Fl_Check_Button *)o)->value() != 0 );
+}
+
+void TraceUI::cb_exposureSlides(Fl_Widget* o, void* v)
+{
+	TraceUI* pUI=(TraceUI*)(o->user_data());
+
+	pUI->m_dExposure=((Fl_Slider *)o)->value();
+	pUI->updateToneMap();
+}
+
+void TraceUI::cb_softHighlights(Fl_Widget* o, void* v)
+{
+	TraceUI* pUI=(TraceUI*)(o->user_data());
+
+	pUI->m_bSoftHighlights = ( ((Fl_Check_Button *)o)->value() != 0 );
+	pUI->updateToneMap();
+}
+
 void TraceUI::cb_render(Fl_Widget* o, void* v)
 {
 	char buffer[256];
@@ -106,6 +132,13 @@ void TraceUI::cb_render(Fl_Widget* o, void* v)
 		pUI->m_traceGlWindow->show();
 
 		pUI->raytracer->traceSetup(width, height);
+		pUI->raytracer->setDepth(pUI->getDepth());
+		pUI->raytracer->setAntialias(pUI->getAntialias());
+
+		if (pUI->m_bProgressive) {
+			pUI->renderProgressive(width, height);
+			return;
+		}
 		
 		// Save the window label
 		const char *old_label = pUI->m_traceGlWindow->label();
@@ -169,6 +202,45 @@ void TraceUI::cb_render(Fl_Widget* o, void* v)
 	}
 }
 
+// Render on the thread pool in the background, coarse blocks first, and
+// keep the UI responsive meanwhile.  The window is redrawn whenever more
+// tiles are finished, from a copy of the buffer that only has whole
+// tiles in it (see RayTracer::copyBuffer).
+void TraceUI::renderProgressive(int width, int height)
+{
+	char buffer[256];
+
+	// Save the window label
+	const char *old_label = m_traceGlWindow->label();
+
+	done=false;
+	raytracer->startProgressive(0);
+
+	int shown = -1;
+	while (!done && !raytracer->progressiveDone()) {
+		Fl::wait(0.03);
+
+		int tiles = raytracer->progress();
+		if (tiles != shown) {
+			shown = tiles;
+			m_traceGlWindow->refresh();
+
+			// update the window label
+			sprintf(buffer, "(%d%%) %s", (int)((double)tiles / (double)raytracer->progressTotal() * 100.0), old_label);
+			m_traceGlWindow->label(buffer);
+		}
+	}
+
+	// A scene loaded meanwhile has already cancelled the render; otherwise
+	// this stops it, or just joins the finished render thread.
+	raytracer->stopProgressive();
+	done=true;
+	m_traceGlWindow->refresh();
+
+	// Restore the window label
+	m_traceGlWindow->label(old_label);
+}
+
 void TraceUI::cb_stop(Fl_Widget* o, void* v)
 {
 	done=true;
@@ -195,6 +267,20 @@ int TraceUI::getDepth()
 	return m_nDepth;
 }
 
+int TraceUI::getAntialias()
+{
+	return m_nAntialias;
+}
+
+// Map the rendered radiance again with the current exposure and curve;
+// nothing is traced again.
+void TraceUI::updateToneMap()
+{
+	ToneMap::Curve curve = m_bSoftHighlights ? ToneMap::REINHARD : ToneMap::CLAMP;
+	raytracer->setToneMap(ToneMap(curve, m_dExposure));
+	m_traceGlWindow->refresh();
+}
+
 // menu definition
 Fl_Menu_Item TraceUI::menuitems[] = {
 	{ "&File",		0, 0, 0, FL_SUBMENU },
@@ -214,7 +300,11 @@ TraceUI::TraceUI() {
 	// init.
 	m_nDepth = 0;
 	m_nSize = 150;
-	m_mainWindow = new Fl_Window(100, 40, 320, 100, "Ray <Not Loaded>");
+	m_nAntialias = 0;
+	m_bProgressive = true;
+	m_dExposure = 0.0;
+	m_bSoftHighlights = false;
+	m_mainWindow = new Fl_Window(100, 40, 320, 155, "Ray <Not Loaded>");
 		m_mainWindow->user_data((void*)(this));	// record self to be used by static callback functions
 		// install menu bar
 		m_menubar = new Fl_Menu_Bar(0, 0, 320, 25);
@@ -246,6 +336,19 @@ TraceUI::TraceUI() {
 		m_sizeSlider->align(FL_ALIGN_RIGHT);
 		m_sizeSlider->callback(cb_sizeSlides);
 
+		// install slider anti-aliasing
+		m_aaSlider = new Fl_Value_Slider(10, 80, 180, 20, "AA");
+		m_aaSlider->user_data((void*)(this));	// record self to be used by static callback functions
+		m_aaSlider->type(FL_HOR_NICE_SLIDER);
+        m_aaSlider->labelfont(FL_COURIER);
+        m_aaSlider->labelsize(12);
+		m_aaSlider->minimum(0);
+		m_aaSlider->maximum(4);
+		m_aaSlider->step(1);
+		m_aaSlider->value(m_nAntialias);
+		m_aaSlider->align(FL_ALIGN_RIGHT);
+		m_aaSlider->callback(cb_aaSlides);
+
 		m_renderButton = new Fl_Button(240, 27, 70, 25, "&Render");
 		m_renderButton->user_data((void*)(this));
 		m_renderButton->callback(cb_render);
@@ -254,6 +357,30 @@ TraceUI::TraceUI() {
 		m_stopButton->user_data((void*)(this));
 		m_stopButton->callback(cb_stop);
 
+		m_exposureSlider = new Fl_Value_Slider(10, 105, 180, 20, "Exposure");
+		m_exposureSlider->user_data((void*)(this));	// record self to be used by static callback functions
+		m_exposureSlider->type(FL_HOR_NICE_SLIDER);
+        m_exposureSlider->labelfont(FL_COURIER);
+        m_exposureSlider->labelsize(12);
+		m_exposureSlider->minimum(-4);
+		m_exposureSlider->maximum(4);
+		m_exposureSlider->step(0.1);
+		m_exposureSlider->value(m_dExposure);
+		m_exposureSlider->align(FL_ALIGN_RIGHT);
+		m_exposureSlider->callback(cb_exposureSlides);
+
+		m_progressiveButton = new Fl_Check_Button(10, 130, 120, 20, "&Progressive");
+		m_progressiveButton->user_data((void*)(this));
+		m_progressiveButton->labelsize(12);
+		m_progressiveButton->value(m_bProgressive);
+		m_progressiveButton->callback(cb_progressive);
+
+		m_softButton = new Fl_Check_Button(130, 130, 150, 20, "Soft &highlights");
+		m_softButton->user_data((void*)(this));
+		m_softButton->labelsize(12);
+		m_softButton->value(m_bSoftHighlights);
+		m_softButton->callback(cb_softHighlights);
+
 		m_mainWindow->callback(cb_exit2);
 		m_mainWindow->when(FL_HIDE);
     m_mainWindow->end();
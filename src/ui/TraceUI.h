@@ -28,10 +28,15 @@ public:
 
 	Fl_Slider*			m_sizeSlider;
 	Fl_Slider*			m_depthSlider;
+	Fl_Slider*			m_aaSlider;
+	Fl_Slider*			m_exposureSlider;
 
 	Fl_Button*			m_renderButton;
 	Fl_Button*			m_stopButton;
 
+	Fl_Check_Button*	m_progressiveButton;
+	Fl_Check_Button*	m_softButton;
+
 	TraceGLWindow*		m_traceGlWindow;
 
 	// member functions
@@ -41,12 +46,17 @@ public:
 
 	int			getSize();
 	int			getDepth();
+	int			getAntialias();
 
 private:
 	RayTracer*	raytracer;
 
 	int			m_nSize;
 	int			m_nDepth;
+	int			m_nAntialias;
+	bool		m_bProgressive;
+	double		m_dExposure;
+	bool		m_bSoftHighlights;
 
 // static class members
 	static Fl_Menu_Item menuitems[];
@@ -62,9 +72,16 @@ private:
 
 	static void cb_sizeSlides(Fl_Widget* o, void* v);
 	static void cb_depthSlides(Fl_Widget* o, void* v);
+	static void cb_aaSlides(Fl_Widget* o, void* v);
+	static void cb_progressive(Fl_Widget* o, void* v);
+	static void cb_exposureSlides(Fl_Widget* o, void* v);
+	static void cb_softHighlights(Fl_Widget* o, void* v);
 
 	static void cb_render(Fl_Widget* o, void* v);
 	static void cb_stop(Fl_Widget* o, void* v);
+
+	void renderProgressive(int width, int height);
+	void updateToneMap();
 };
 
 #endif